@@ -5,7 +5,8 @@ int main();
 
 void _start() {
     int exitval = main();
-    // cease( exitval );
+    // the exit system call, back to the kernel that started us
+    __asm__ volatile ( "int $0x80" :: "a"( 2 ), "b"( exitval ) );
 }
 
 int main() {
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/info.hpp>
+
+#define PACKED __attribute__((packed))
+
+namespace kernel::acpi {
+
+    // root system description pointer, as multiboot copies it
+    struct rsdp {
+        char signature[ 8 ];
+        uint8_t checksum;
+        char oem_id[ 6 ];
+        uint8_t revision;
+        uint32_t rsdt;
+
+        // revision 2 and later
+        uint32_t length;
+        uint64_t xsdt;
+        uint8_t extended_checksum;
+        uint8_t reserved[ 3 ];
+    } PACKED;
+
+    struct header {
+        char signature[ 4 ];
+        uint32_t length;
+        uint8_t revision;
+        uint8_t checksum;
+        char oem_id[ 6 ];
+        char oem_table_id[ 8 ];
+        uint32_t oem_revision;
+        uint32_t creator_id;
+        uint32_t creator_revision;
+    } PACKED;
+
+    // multiple APIC description table, its entries follow the fixed part
+    struct madt {
+        header head;
+        uint32_t lapic;
+        uint32_t flags;     // 1 if the board has 8259s as well
+
+        struct entry {
+            enum type : uint8_t {
+                local_apic = 0,
+                io_apic = 1,
+                source_override = 2,
+                lapic_override = 5,
+            };
+
+            uint8_t type;
+            uint8_t length;
+        } PACKED;
+
+        struct local_apic : entry {
+            uint8_t processor;
+            uint8_t apic_id;
+            uint32_t flags;     // 1 if the processor is enabled
+        } PACKED;
+
+        struct io_apic : entry {
+            uint8_t id;
+            uint8_t reserved;
+            uint32_t address;
+            uint32_t gsi_base;
+        } PACKED;
+
+        // an ISA interrupt wired to another input, or with other polarity
+        struct source_override : entry {
+            uint8_t bus;
+            uint8_t source;
+            uint32_t gsi;
+            uint16_t flags;
+        } PACKED;
+
+        struct lapic_override : entry {
+            uint16_t reserved;
+            uint64_t address;
+        } PACKED;
+
+        template< typename Fn >
+        void yield( Fn fn ) const {
+            auto begin = reinterpret_cast< const uint8_t * >( this ) + sizeof( madt );
+            auto end = reinterpret_cast< const uint8_t * >( this ) + head.length;
+            for ( auto it = begin; it + sizeof( entry ) <= end; it += reinterpret_cast< const entry * >( it )->length ) {
+                auto item = reinterpret_cast< const entry * >( it );
+                if ( item->length < sizeof( entry ) )
+                    break;
+                fn( item );
+            }
+        }
+    } PACKED;
+
+    // Finds the root tables through the multiboot acpi_new or acpi_old
+    // tag, false when the loader passed neither or the checksum is wrong.
+    bool init( const multiboot::info & info );
+
+    // A table mapped into the kernel part, nullptr when it is missing.
+    // The mapping stays until release.
+    const header * find( const char * signature );
+    void release( const header * table );
+
+} // namespace kernel::acpi
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/info.hpp>
+
+namespace kernel::apic {
+
+    // the local APIC raises it for interrupts that went away, no EOI wanted
+    static constexpr uint8_t spurious_vector = 0xFF;
+
+    static constexpr size_t max_cpus = 16;
+    static constexpr size_t max_io_apics = 4;
+
+    // local APIC registers, byte offsets
+    struct reg {
+        static constexpr uint32_t id = 0x20;
+        static constexpr uint32_t task_priority = 0x80;
+        static constexpr uint32_t eoi = 0xB0;
+        static constexpr uint32_t spurious = 0xF0;
+    };
+
+    // registers of the local APIC, nullptr while the 8259s are in charge
+    extern volatile uint32_t * local;
+
+    inline bool active() { return local != nullptr; }
+
+    // one store, no port I/O
+    inline void eoi() { local[ reg::eoi / 4 ] = 0; }
+
+    // Takes over from the 8259s when the CPU has a local APIC and the ACPI
+    // MADT lists an I/O APIC. The ISA interrupts keep their vectors 32-47
+    // and go to the boot processor. False leaves the PIC in charge.
+    bool init( const multiboot::info & info );
+
+    // Points an I/O APIC input at the vector on the CPU with the APIC id,
+    // the input stays masked if it was.
+    void route( uint32_t gsi, uint8_t vector, uint8_t cpu );
+
+    // ISA interrupts by their number, wherever the board wired them
+    void mask( unsigned irq );
+    void unmask( unsigned irq );
+    uint32_t gsi_of( unsigned irq );
+
+    // APIC ids of the enabled processors, the boot processor among them
+    extern uint8_t cpus[ max_cpus ];
+    extern size_t num_of_cpus;
+
+} // namespace kernel::apic
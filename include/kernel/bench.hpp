@@ -0,0 +1,21 @@
+#pragma once
+
+namespace kernel {
+    namespace bench {
+
+        // Micro benchmarks, built only with -DTHINGY_BENCH (make BENCH=1).
+        // Every result is one line on the serial port:
+        //   bench <name> key=value ...
+
+        // cycles to refill the TLB for kernel pages after a CR3 reload,
+        // with and without global pages
+        void tlb_refill();
+
+        // cycles of a null system call from user mode and back, through
+        // the int 0x80 gate and through sysenter, only with THINGY_BENCH
+        void syscall_roundtrip();
+
+        void run();
+
+    } // namespace bench
+} // namespace kernel
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace kernel::cpu {
+
+    // feature bits reported by cpuid leaf 1 in edx
+    enum feature : uint32_t {
+        pse = 1 << 3,   // 4 MiB pages
+        tsc = 1 << 4,   // time stamp counter
+        msr = 1 << 5,   // rdmsr and wrmsr
+        pae = 1 << 6,   // physical address extension
+        apic = 1 << 9,  // on-chip local APIC
+        sep = 1 << 11,  // sysenter and sysexit
+        pge = 1 << 13,  // global pages
+    };
+
+    static inline uint32_t features() {
+        uint32_t eax = 1, ebx, ecx, edx;
+        asm volatile ( "cpuid" : "+a"( eax ), "=b"( ebx ), "=c"( ecx ), "=d"( edx ) );
+        return edx;
+    }
+
+    static inline bool has( feature f ) {
+        return features() & f;
+    }
+
+    struct cr4 {
+        static constexpr uint32_t pse = 1 << 4;
+        static constexpr uint32_t pae = 1 << 5;
+        static constexpr uint32_t pge = 1 << 7;
+
+        static uint32_t get() {
+            uint32_t cr4;
+            asm volatile ( "movl %%cr4, %%eax" : "=a"( cr4 ) );
+            return cr4;
+        }
+
+        static void set( uint32_t val ) {
+            asm volatile ( "movl %%eax, %%cr4" :: "a"( val ) );
+        }
+    };
+
+    // drops every non-global translation
+    static inline void reload_cr3() {
+        asm volatile ( "movl %%cr3, %%eax; movl %%eax, %%cr3" ::: "eax", "memory" );
+    }
+
+    static inline uint64_t rdmsr( uint32_t msr ) {
+        uint32_t lo, hi;
+        asm volatile ( "rdmsr" : "=a"( lo ), "=d"( hi ) : "c"( msr ) );
+        return ( uint64_t( hi ) << 32 ) | lo;
+    }
+
+    static inline void wrmsr( uint32_t msr, uint64_t val ) {
+        asm volatile ( "wrmsr" :: "a"( uint32_t( val ) ), "d"( uint32_t( val >> 32 ) ), "c"( msr ) );
+    }
+
+    static inline uint64_t rdtsc() {
+        uint32_t lo, hi;
+        asm volatile ( "rdtsc" : "=a"( lo ), "=d"( hi ) );
+        return ( uint64_t( hi ) << 32 ) | lo;
+    }
+
+} // namespace kernel::cpu
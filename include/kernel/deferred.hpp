@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/dt.hpp>
+
+namespace kernel::deferred {
+
+    // A unit of work an interrupt handler hands off. It runs once per
+    // queue, after the EOI with interrupts enabled, before the interrupted
+    // code continues. Like the handler it must not use the allocators.
+    struct work {
+        using function = void (*) ( work * );
+
+        function fn;
+        work * next;
+        bool queued;
+        uint64_t since;     // TSC when it was queued
+    };
+
+    // Puts the item on the pending list of the vector, false when it is
+    // already queued. Lock-free, any handler may call it.
+    bool queue( unsigned vector, work * item );
+
+    struct counters {
+        uint64_t queued;
+        uint64_t run;
+        uint32_t depth;         // items waiting right now
+        uint32_t max_depth;
+        uint64_t cycles;        // from queue to run, summed
+        uint64_t max_cycles;
+    };
+
+    // per vector
+    extern counters count[ idt::size ];
+
+    // Prints the vectors that ever had work, one line each:
+    //   irq deferred vector=.. queued=.. run=.. depth=.. max_depth=.. avg_cycles=.. max_cycles=..
+    void report();
+
+} // namespace kernel::deferred
+
+extern "C" {
+    // nonzero while some vector has work, the IRQ path checks it
+    extern volatile uint32_t deferred_pending;
+
+    void deferred_run();
+}
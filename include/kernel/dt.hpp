@@ -32,16 +32,32 @@ namespace kernel {
 
 	namespace irq {
 		static constexpr size_t num_of_handlers = 16;
+		// vector of ISA interrupt 0, exceptions take the ones below
+		static constexpr size_t base_vector = 32;
 
-		using handler = void (*) ( registers_t * );
+		// Runs on the light path, only eax, ecx and edx are saved and the
+		// interrupt is already acknowledged.
+		using handler = void (*) ( unsigned vector );
 
+		// ISA interrupts by their number
 		void install_handler( unsigned irq, irq::handler handler );
 		void uninstall_handler( unsigned irq );
 
+		// any vector from base_vector up, IPIs and MSIs as well
+		void install_vector( unsigned vector, irq::handler handler );
+		void uninstall_vector( unsigned vector );
+
+		// the light path acknowledges with a store here, nullptr leaves it to the PIC
+		extern "C" volatile uint32_t * irq_eoi_register;
+
 		void remap();
 
 		void inti();
 
+		// masks an ISA interrupt at the APIC or the PIC, whichever is in charge
+		void enable( unsigned irq );
+		void disable( unsigned irq );
+
 		namespace pic {
             static constexpr uint8_t PORT_DATA[ 2 ] = { 0x21, 0xA1 };
 
@@ -62,7 +78,10 @@ namespace kernel {
 	namespace isrs {
 		static constexpr size_t num_of_handlers = 32;
 
-		void install_handler( unsigned isrs, irq::handler handler );
+		// exceptions see every register of the interrupted code
+		using handler = void (*) ( registers_t * );
+
+		void install_handler( unsigned isrs, isrs::handler handler );
 		void uninstall_handler( unsigned isrs );
 
 		void inti();
@@ -83,8 +102,11 @@ namespace kernel {
 
         static constexpr size_t size = 256;
 
-        template< size_t idx >
-        void set( irq::handler handler, uint16_t selector = 0x08, uint8_t flags = 0x8E );
+        // the stubs of boot.S lie this far apart, starting at interrupt_stubs
+        static constexpr size_t stub_size = 16;
+
+        // flags 0xEE lets user code raise the vector with int
+        void set( size_t idx, const void * stub, uint16_t selector = 0x08, uint8_t flags = 0x8E );
 
         static void init();
     } PACKED;
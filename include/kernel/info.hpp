@@ -49,6 +49,9 @@ namespace multiboot {
 
         information_item * begin() const;
 
+        uintptr_t address() const { return reinterpret_cast< uintptr_t >( list ); }
+        uint32_t size() const { return *reinterpret_cast< const uint32_t * >( list ); }
+
         memory_info mem() const;
 
         template< typename Fn >
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/dt.hpp>
+
+namespace kernel::irq::stats {
+
+    // Built only with -DTHINGY_IRQ_STATS (make IRQSTATS=1), otherwise the
+    // interrupt stubs carry no hooks at all.
+#ifdef THINGY_IRQ_STATS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    // bucket b holds durations of [ 2^b, 2^(b+1) ) TSC cycles
+    static constexpr size_t buckets = 32;
+
+    struct vector {
+        uint64_t count;
+        uint64_t cycles;            // in the handler, summed
+        uint64_t max_cycles;
+        uint32_t handler[ buckets ];    // from the stub to the handler's return
+        uint32_t disabled[ buckets ];   // from the stub until interrupts are back on
+    };
+
+    extern vector vectors[ idt::size ];
+
+    // starts counting rates from zero
+    void reset();
+
+    // Prints every vector that fired since the reset, over serial:
+    //   irq vector=.. count=.. window=.. avg_cycles=.. max_cycles=..
+    //   irq handler vector=.. b<k>=.. ...
+    //   irq disabled vector=.. b<k>=.. ...
+    // window is the TSC cycles since the reset, rate = count / window.
+    void report();
+
+} // namespace kernel::irq::stats
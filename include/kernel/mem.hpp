@@ -11,52 +11,92 @@
 namespace kernel::mem {
 
     namespace phys {
+#ifdef THINGY_PAE
+        using address_t = uint64_t;
+#else
 	    using address_t = uint32_t;
+#endif
     }
 
     namespace virt {
         using address_t = uint32_t;
+
+        // kernel mappings live between the identity map and user_begin
+        static constexpr address_t kernel_end = 0x40000000;
+        static constexpr address_t user_begin = 0x40000000;
+        // the page tables of the current address space are mapped above
+#ifdef THINGY_PAE
+        static constexpr address_t user_end = 0xFF800000;
+#else
+        static constexpr address_t user_end = 0xFFC00000;
+#endif
     }
 
+    // the stack user code enters the kernel on, by an interrupt or sysenter
     void set_kernel_stack( uintptr_t stack );
 
     namespace paging {
 
         struct page_entry {
-            union alignas( 4 ) {
-                uint32_t raw;
+#ifdef THINGY_PAE
+            using raw_t = uint64_t;
+            static constexpr raw_t frame_mask = 0x000FFFFFFFFFF000ull;
+#else
+            using raw_t = uint32_t;
+            static constexpr raw_t frame_mask = 0xFFFFF000;
+#endif
+            // not present yet, a zeroed frame is mapped on the first touch
+            static constexpr uint32_t demand_zero = 0x200;
+            // a directory entry mapping a whole large page
+            static constexpr uint32_t large = 0x80;
+            // read-only because the frame is shared, a write fault copies it
+            static constexpr uint32_t cow = 0x400;
+            // the contents are in a checkpoint of the space, see snapshot.hpp
+            static constexpr uint32_t saved = 0x800;
+
+            union alignas( sizeof( raw_t ) ) {
+                raw_t raw;
                 struct {
-					uint32_t present    : 1;   // Page present in memory
-					uint32_t rw         : 1;   // Read-only if clear, readwrite if set
-					uint32_t user       : 1;   // Supervisor level only if clear
-					uint32_t accessed   : 1;   // Has the page been accessed since last refresh?
-					uint32_t dirty      : 1;   // Has the page been written to since last refresh?
-					uint32_t unused     : 7;   // Amalgamation of unused and reserved bits
-					uint32_t frame      : 20;  // Frame address (shifted right 12 bits)
+					raw_t present    : 1;   // Page present in memory
+					raw_t rw         : 1;   // Read-only if clear, readwrite if set
+					raw_t user       : 1;   // Supervisor level only if clear
+					raw_t pwt        : 1;   // Write-through caching
+					raw_t pcd        : 1;   // Caching disabled
+					raw_t accessed   : 1;   // Has the page been accessed since last refresh?
+					raw_t dirty      : 1;   // Has the page been written to since last refresh?
+					raw_t pat        : 1;   // Page attribute index, page size in a directory
+					raw_t global     : 1;   // Kept in the TLB across CR3 reloads
+					raw_t available  : 3;   // Left to the kernel
+#ifdef THINGY_PAE
+					raw_t frame      : 40;  // Frame address (shifted right 12 bits)
+					raw_t reserved   : 11;
+					raw_t nx         : 1;   // No execute, if enabled in EFER
+#else
+					raw_t frame      : 20;  // Frame address (shifted right 12 bits)
+#endif
 				};
             };
+
+            phys::address_t addr() const { return raw & frame_mask; }
+            uint32_t flags() const { return raw & 0xfff; }
         };
 
 		struct page_table {
+#ifdef THINGY_PAE
+			static constexpr size_t size = 512;
+#else
 			static constexpr size_t size = 1024;
+#endif
 			page_entry pages[ size ];
 
+			// zeroed and identity mapped, for directories that are not current
 			static page_table * create();
-			static page_table * empty();
-		};
-
-
-		struct page_directory {
-			static constexpr size_t size = 1024;
-			page_table * tables[ size ];
-
-			static page_directory * create();
 		};
 
 		struct page {
             static constexpr size_t size = 4096;
 
-            static constexpr size_t index( virt::address_t addr ) {
+            static constexpr size_t index( uint64_t addr ) {
                 return addr / size;
             }
 
@@ -64,58 +104,234 @@ namespace kernel::mem {
             size_t num;
         };
 
-        page_entry & get_page( virt::address_t addr );
+        // what one directory entry covers, 4 MiB or 2 MiB with PAE
+        static constexpr size_t large_page_size = page_table::size * page::size;
+
+        static constexpr size_t dir_index( virt::address_t addr ) {
+            return addr / large_page_size;
+        }
+
+        // With PAE the four directories lie back to back and are indexed
+        // as one, the page directory pointer table comes after them.
+		struct page_directory {
+			static constexpr size_t size = ( uint64_t( 1 ) << 32 ) / large_page_size;
+			page_entry tables[ size ];
+#ifdef THINGY_PAE
+            alignas( 32 ) uint64_t pdpt[ 4 ];
+#endif
+
+			static page_directory * create();
+		};
+
+        static constexpr size_t directory_frames = ( sizeof( page_directory ) + page::size - 1 ) / page::size;
+
+        // The last directory entries point back at the directory, so the
+        // tables of the current address space show up as one array of
+        // entries at tables_base, the directory itself as its last pages.
+        static constexpr virt::address_t tables_base = virt::user_end;
+        static constexpr virt::address_t directory_base = tables_base + dir_index( tables_base ) * page::size;
+
+        inline page_entry & get_dir_entry( virt::address_t addr ) {
+            return reinterpret_cast< page_entry * >( directory_base )[ dir_index( addr ) ];
+        }
+
+        // only valid when the directory entry points to a table
+        inline page_entry & get_page( virt::address_t addr ) {
+            return reinterpret_cast< page_entry * >( tables_base )[ page::index( addr ) ];
+        }
 
     } // namespace paging
 
     inline phys::address_t virt_2_phys( virt::address_t addr ) {
-        return ( paging::get_page( addr ).raw & ~0xfff ) | ( addr & 0xfff );
+        auto dir = paging::get_dir_entry( addr );
+        if ( dir.raw & paging::page_entry::large )
+            return ( dir.addr() & ~phys::address_t( paging::large_page_size - 1 ) ) | ( addr & ( paging::large_page_size - 1 ) );
+
+        return paging::get_page( addr ).addr() | ( addr & 0xfff );
+    }
+
+    // frames of the direct zone are reachable through the identity map
+    inline void * phys_2_virt( phys::address_t addr ) {
+        return reinterpret_cast< void * >( uintptr_t( addr ) );
     }
 
+    // Binary buddy allocator of physical frames. Free blocks of 2^order
+    // frames are kept in per-order lists of each zone, a failed allocation
+    // returns an invalid frame (size 0).
     struct frame_allocator {
+        enum zone : uint8_t {
+            direct,     // inside the identity map, the kernel can touch it anywhere
+            high,       // above it, reachable only through a mapping
+            num_of_zones
+        };
+
         struct frame {
             phys::address_t addr;
             size_t size;
+
+            bool valid() const { return size != 0; }
         };
 
+        static constexpr size_t max_order = 10; // 4 MiB blocks
+        static constexpr uint32_t no_frame = ~0u;
+        static constexpr size_t zero_pool_size = 64;
+
         frame alloc();
-        frame alloc( size_t num );
+        frame alloc( size_t num, zone z = direct );
+
+        // A single frame filled with zeros, taken from a pool that prezero
+        // refills when the CPU has nothing better to do. prezero is false
+        // once the pool is full or memory runs out.
+        frame alloc_zeroed();
+        bool prezero();
 
-        void skip_allocated_frames();
+        // Up to num frames as at most max_runs contiguous runs, the biggest
+        // blocks first and high frames before direct ones, the caller maps
+        // them. Returns the number of runs, fewer frames than asked for only
+        // when memory or runs are exhausted.
+        size_t alloc( size_t num, frame * runs, size_t max_runs );
 
         void free( frame );
 
+        // Takes over the frames of a boot module, they are freed like any
+        // other frames afterwards. Invalid if the module shares a frame
+        // with other boot data and has to be copied instead.
+        frame adopt( const multiboot::modules_information & mod );
+
         static void init( const multiboot::info & info );
 
-        size_t last = 0;
+        // Frames mapped by more than one address space count their extra
+        // mappings. unshare drops one and is false when none was left.
+        void share( phys::address_t addr );
+        bool unshare( phys::address_t addr );
+
+        // blocks of the order in the free list of the zone
+        size_t free_blocks( zone z, size_t order ) const;
+
+        void push( size_t idx, size_t order );
+        void remove( size_t idx );
+        void release( size_t idx, size_t order );
+        void release_range( size_t idx, size_t num );
+
+        uint32_t free_lists[ num_of_zones ][ max_order + 1 ];
+        size_t free_frames;
+        size_t total_frames;
+        size_t reserved_frames;    // never free since boot
+
+        phys::address_t zeroed[ zero_pool_size ];
+        size_t num_zeroed;
     };
 
     extern frame_allocator falloc;
 
+    // Free virtual ranges of one part of the address space. The ranges sit
+    // in a treap ordered by address and every node knows the largest range
+    // in its subtree, so first fit, reservation and release are O(log n).
+    struct space_index {
+        struct range {
+            virt::address_t addr;
+            size_t num;         // pages
+            size_t largest;     // the most pages of a range in this subtree
+            uint32_t priority;
+            range * left;
+            range * right;
+        };
+
+        void init( virt::address_t begin, virt::address_t end );
+        void copy( const space_index & other );
+        void clear();
+
+        virt::address_t alloc( size_t num );
+        bool reserve( virt::address_t addr, size_t num );
+        void release( virt::address_t addr, size_t num );
+
+        range * root = nullptr;
+    };
+
+    // A directory of its own, sharing the kernel tables with every other
+    // one, and the free ranges of its user part.
+    namespace wss { struct tracker; }
+
+    struct address_space {
+        paging::page_directory * dir;
+        space_index user_space;
+        wss::tracker * working_set;
+        uint32_t checkpoints;
+
+        static address_space * create();
+
+        // shares all user frames read-only, a write fault copies the page
+        address_space * clone();
+        void destroy();
+
+        void activate();
+    };
+
     struct page_allocator {
 
         paging::page alloc( size_t num, bool user = false );
         void free( paging::page page );
 
-        virt::address_t skip_used_pages( virt::address_t addr );
-        size_t unused_space_from_addr( virt::address_t virt, bool user, size_t bound );
+        // like alloc, but frames are only mapped by the page fault handler
+        paging::page reserve( size_t num, bool user = false );
+
+        bool populate( virt::address_t addr, size_t num, bool user, bool lazy );
+
+        // reserves num pages of the kernel or user part, 0 if there is no room
         virt::address_t find_space( size_t num, bool user );
+        void release_space( virt::address_t addr, size_t num );
+
+        space_index & space( bool user ) { return user ? current->user_space : kernel_space; }
 
-        void map( virt::address_t virt, phys::address_t phys, uint32_t flags );
+        // grows a mapped run to num pages, in place when the following
+        // pages are unused, otherwise by moving the mapping; no data is copied
+        paging::page remap( paging::page page, size_t num, bool user = false );
+
+        void map( phys::address_t phys, virt::address_t virt, uint32_t flags );
         void unmap( virt::address_t virt );
 
+        // Range operations look every page table up once and invalidate
+        // the TLB once at the end. unmap_range hands the frames back to
+        // falloc unless release is false.
+        void map_range( virt::address_t virt, phys::address_t phys, size_t num, uint32_t flags );
+        void unmap_range( virt::address_t virt, size_t num, bool release = true );
+        void protect_range( virt::address_t virt, size_t num, uint32_t flags );
+
+        // Maps memory the frame allocator does not own, firmware tables or
+        // device registers, into the kernel part. Returns the address of
+        // phys, 0 when there is no room.
+        virt::address_t map_physical( phys::address_t phys, size_t size, uint32_t flags = kernel_flags );
+        void unmap_physical( virt::address_t virt, size_t size );
+
+        // invlpg for a few pages, a whole TLB flush above invlpg_threshold
+        void flush( virt::address_t virt, size_t num, bool global );
+
         static void init( frame_allocator * allocator );
 
         static constexpr uint32_t kernel_flags = 0x103;
         static constexpr uint32_t user_flags = 0x07;
+        // write-through and cache disabled, for device registers
+        static constexpr uint32_t uncached = 0x18;
+
+        // runs of at least this many pages are backed on demand
+        static constexpr size_t lazy_threshold = 16;
+        static constexpr size_t invlpg_threshold = 32;
+        // frame runs populate takes from falloc at a time
+        static constexpr size_t max_runs = 32;
 
         frame_allocator * allocator;
+        space_index kernel_space;
+        address_space * current;
     };
 
     extern page_allocator palloc;
 
     void * kmalloc_page_aligned( size_t size );
 
+    // General purpose heap for blocks too big for the slabs. Every block
+    // carries a header and a footer, so free() can merge it with both
+    // neighbours. Blocks live in regions of whole pages delimited by
+    // fences, a region that becomes completely free goes back to palloc.
     struct allocator {
         void * alloc( size_t size, bool user = false );
         void * realloc( void * ptr, size_t size, bool user = false );
@@ -123,22 +339,26 @@ namespace kernel::mem {
 
         struct alignas( 8 ) node {
             static constexpr uint32_t magic = 0xDEADBEEF;
+            static constexpr size_t fence = ~size_t( 0 );
 
-            struct metadata_header {
+            struct alignas( 8 ) metadata_header {
                 uint32_t magic_begin;
                 size_t size;
                 node * next;
+                node * prev;
                 bool free;
                 bool user;
                 uint32_t magic_end;
             };
 
-            struct metadata_footer {
+            struct alignas( 8 ) metadata_footer {
                 uint32_t magic_begin;
                 size_t size;
                 uint32_t magic_end;
             };
 
+            static constexpr size_t overhead = sizeof( metadata_header ) + sizeof( metadata_footer );
+
             metadata_header __header;
 
             metadata_header & header() { return __header; }
@@ -155,12 +375,27 @@ namespace kernel::mem {
                                                              + __header.size );
             }
 
+            // footer of the block right before this one, a fence at the region start
+            metadata_footer & prev_footer() {
+                return *( reinterpret_cast< metadata_footer * >(
+                    reinterpret_cast< uintptr_t >( this ) - sizeof( metadata_footer ) ) );
+            }
+
+            node * prev() {
+                return reinterpret_cast< node * >(
+                       reinterpret_cast< uintptr_t >( this ) - sizeof( metadata_header )
+                                                             - sizeof( metadata_footer )
+                                                             - prev_footer().size );
+            }
+
             bool check() {
                 return __header.magic_begin == magic && __header.magic_end == magic;
             }
 
             bool fit( size_t size, bool user );
 
+            void init( size_t size, bool free, bool user );
+
             void * data() {
                 return reinterpret_cast< void * >(
                     reinterpret_cast< uintptr_t >( this ) + sizeof( metadata_header )
@@ -169,11 +404,65 @@ namespace kernel::mem {
 
         };
 
+        // fences around the blocks of a region plus the metadata of the first block
+        static constexpr size_t region_overhead = sizeof( node::metadata_footer ) + node::overhead
+                                                + sizeof( node::metadata_header );
+
+        node * grow( size_t size, bool user );
+        node * take( node * block, size_t size );
+        void split( node * block, size_t size );
+        node * remap( node * block, size_t size );
+
+        void link( node * block );
+        void unlink( node * block );
+
         node * freelist = nullptr;
     };
 
     extern allocator _allocator;
 
+    // Small objects come from page sized slabs. Every size class keeps a
+    // list of slabs that still have free objects, so both alloc and free
+    // are constant time.
+    struct slab_allocator {
+        struct slab {
+            static constexpr uint32_t magic = 0x51AB51AB;
+
+            uint32_t magic_begin;
+            uint32_t cls;
+            uint32_t used;
+            void * free;
+            slab * next;
+            slab * prev;
+
+            void * objects() {
+                return reinterpret_cast< void * >( reinterpret_cast< uintptr_t >( this ) + header_size );
+            }
+        };
+
+        static constexpr size_t min_size = 8;
+        static constexpr size_t header_size = ( sizeof( slab ) + min_size - 1 ) & ~( min_size - 1 );
+        // the largest class still fits twice into a slab
+        static constexpr size_t max_size = ( ( paging::page::size - header_size ) / 2 ) & ~( min_size - 1 );
+        static constexpr size_t num_of_classes = 9; // 8 B .. 1 KiB and max_size
+
+        static size_t size_class( size_t size );
+        static size_t class_size( size_t cls );
+
+        void * alloc( size_t size );
+        void free( void * ptr );
+
+        static slab * slab_of( void * ptr );
+
+        slab * partial[ num_of_classes ] = { nullptr };
+    };
+
+    extern slab_allocator salloc;
+
+    void * kmalloc( size_t size );
+    void * krealloc( void * ptr, size_t size );
+    void kfree( void * ptr );
+
     void init( const multiboot::info & info );
 
 } // namespace kernel::mem
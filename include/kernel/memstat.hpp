@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/cpu.hpp>
+#include <kernel/mem.hpp>
+
+namespace kernel::mem::stats {
+
+    // log2 buckets of kmalloc request sizes, the last one takes the rest
+    static constexpr size_t size_buckets = 16;
+
+    // Event counters, bumped by the memory code as things happen.
+    struct counters {
+        uint64_t page_faults;
+        uint64_t demand_zero_faults;
+        uint64_t cow_faults;
+        uint64_t cow_copies;
+
+        uint64_t mapped_pages;
+        uint64_t unmapped_pages;
+        uint64_t invlpg;
+        uint64_t tlb_flushes;
+
+        uint64_t find_space;
+        uint64_t find_space_failures;
+
+        // live objects per slab class and bytes in general heap blocks
+        uint64_t slab_objects[ slab_allocator::num_of_classes ];
+        uint64_t heap_bytes;
+
+        uint64_t request_sizes[ size_buckets ];
+    };
+
+    extern counters count;
+
+    // Allocator entry points whose calls and TSC cycles are accounted.
+    // Times are inclusive, a slab refill counts for palloc and falloc too.
+    enum timer : uint8_t {
+        frame_alloc,
+        frame_free,
+        page_alloc,
+        page_free,
+        slab_alloc,
+        slab_free,
+        heap_alloc,
+        heap_free,
+        num_of_timers
+    };
+
+    struct timing {
+        uint64_t calls;
+        uint64_t cycles;
+    };
+
+    extern timing timings[ num_of_timers ];
+
+    // Timers are built only with -DTHINGY_MEM_TIMES (make MEMTIMES=1) and
+    // need a TSC, otherwise timed does nothing.
+#ifdef THINGY_MEM_TIMES
+    static constexpr bool timing_enabled = true;
+#else
+    static constexpr bool timing_enabled = false;
+#endif
+
+    // accounts the lifetime of the scope to a timer
+    struct timed {
+#ifdef THINGY_MEM_TIMES
+        timed( timer t ) : t( t ), begin( cpu::rdtsc() ) {}
+
+        ~timed() {
+            ++timings[ t ].calls;
+            timings[ t ].cycles += cpu::rdtsc() - begin;
+        }
+
+        timer t;
+        uint64_t begin;
+#else
+        timed( timer ) {}
+#endif
+    };
+
+    void request( size_t size );
+
+    // Prints every counter and the working set of the current space to
+    // the console, one record per line:
+    //   mem <record> key=value ...
+    void report();
+
+} // namespace kernel::mem::stats
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/mem.hpp>
+
+namespace kernel::mem::snapshot {
+
+    // A checkpoint is a header followed by its page records, little endian:
+    //   header  magic, sequence, number of pages
+    //   page    virtual address | flags, then the page unless it is zero
+    // The first checkpoint of a space (sequence 0) has every present user
+    // page, later ones only pages written or mapped since the previous one.
+    // Pages unmapped in between are not recorded.
+    static constexpr uint32_t magic = 0x4B434854; // "THCK"
+
+    struct header {
+        uint32_t magic;
+        uint32_t sequence;
+        uint32_t pages;
+    };
+
+    // flags in the low bits of a page record
+    static constexpr uint32_t zero = 0x1;   // all zeros, no data follows
+
+    // where the stream goes, a serial port or a block device
+    using writer = void (*)( const void * data, size_t size );
+
+    // writes to stdout, which is the serial port
+    void console( const void * data, size_t size );
+
+    // Writes the pages of the space changed since its previous checkpoint,
+    // resets their dirty bits and returns how many pages were recorded.
+    size_t checkpoint( address_space & space, writer out = console );
+
+} // namespace kernel::mem::snapshot
@@ -1,8 +1,32 @@
 #pragma once
 
+#include <stdint.h>
+#include <stddef.h>
+
 namespace kernel {
     namespace syscall {
 
+        // User code enters through int 0x80 or sysenter, with the number in
+        // eax and up to three arguments in ebx, esi and edi. The result comes
+        // back in eax. The int 0x80 gate keeps every other register, sysenter
+        // takes the user stack in ecx and the return address in edx.
+        static constexpr uint8_t vector = 0x80;
+        static constexpr size_t num_of_calls = 64;
+
+        using handler = int (*) ( uint32_t, uint32_t, uint32_t );
+
+        namespace nr {
+            static constexpr uint32_t nop = 0;      // does nothing, the cost of the entry alone
+            static constexpr uint32_t debug = 1;
+            static constexpr uint32_t exit = 2;     // back to whoever called user::enter
+        }
+
+        void install( uint32_t nr, syscall::handler handler );
+        void uninstall( uint32_t nr );
+
+        // whether sysenter is set up, the CPU may lack it
+        bool fast();
+
         void init();
 
         int debug( int );
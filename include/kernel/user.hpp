@@ -3,22 +3,40 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include <kernel/mem.hpp>
+
 namespace kernel {
     namespace user {
 
         static constexpr size_t stack_size = 0x4000;
 
+        // where data/linkscript places the sections
+        static constexpr uint32_t text_base = 0x4C0DE000;
+        static constexpr uint32_t data_base = 0x4DA7A000;
+
         struct executable {
             struct section {
-                uint32_t addr;
+                mem::phys::address_t addr;
                 uint32_t size;
             };
 
             section data;
             section text;
 
-            int start() const;
+            // The sections mapped once: text read-only, data writable. Every
+            // run starts from a clone, so a write copies the page and the
+            // module frames stay as they were loaded.
+            mem::address_space * image = nullptr;
+
+            // runs the program in a space of its own and drops it afterwards
+            int start();
         };
 
+        // Runs user code until it leaves, returns the value it left with.
+        int enter( void * code, void * stack );
+
+        // From a system call, drops the user code and returns from enter.
+        [[noreturn]] void leave( int value );
+
     } // namespace user
 } // namespace kernel
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/mem.hpp>
+
+namespace kernel::mem::wss {
+
+    // Idle ages in powers of two: accessed since the previous scan, idle
+    // for 1 scan, 2-3, 4-7, ... and the last bucket takes the rest.
+    static constexpr size_t age_buckets = 8;
+
+    // ages saturate, pages that are not present stay at it
+    static constexpr uint8_t max_age = 255;
+
+    // the PIT ticks at hz, the current space is scanned every interval ticks
+    static constexpr uint32_t hz = 100;
+    static constexpr uint32_t interval = 100;
+
+    struct histogram {
+        uint32_t pages[ age_buckets ];
+        uint32_t present;
+        uint32_t dirty;     // dirty bits are only sampled, never cleared
+    };
+
+    // Per address space state, made with the space. The ages of a user
+    // table come with the table, so a scan never allocates.
+    struct tracker {
+        static constexpr size_t tables = paging::dir_index( virt::user_end ) - paging::dir_index( virt::user_begin );
+
+        // scans since each page was last seen accessed, per user table
+        uint8_t * ages[ tables ];
+        histogram last;
+        uint64_t scans;
+    };
+
+    // Gives the space a tracker, false when there is no memory for it and
+    // the space goes unscanned.
+    bool track( address_space & space );
+
+    // ages for the user table covering addr, once it exists in the space
+    void add_table( address_space & space, virt::address_t addr );
+
+    // Ages the user pages of the space by their accessed bits, clears the
+    // bits and rebuilds its histogram. Allocates nothing, deferred work may
+    // call it. False for an untracked space or a table without ages, the
+    // histogram is kept as it was then.
+    bool scan( address_space & space );
+
+    // Programs the PIT and scans the current space every interval ticks,
+    // as deferred work of the timer interrupt.
+    void start();
+
+    // pages of the space accessed during its last scans scans
+    size_t estimate( const address_space & space, unsigned scans );
+
+    // drops the tracker of a space that goes away
+    void release( address_space & space );
+
+    // Prints the histogram and estimates of the space, one line:
+    //   mem wss scans=.. present=.. dirty=.. age0=.. age1=.. age2=.. ... wss1=.. wss4=.. wss16=..
+    void report( const address_space & space );
+
+} // namespace kernel::mem::wss
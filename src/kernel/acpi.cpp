@@ -0,0 +1,97 @@
+#include <kernel/acpi.hpp>
+#include <kernel/mem.hpp>
+
+#include <string.h>
+
+namespace kernel::acpi {
+
+    namespace {
+        // physical addresses of the root tables, xsdt is 0 before ACPI 2.0
+        uint32_t rsdt;
+        uint64_t xsdt;
+
+        bool valid( const void * data, size_t size ) {
+            uint8_t sum = 0;
+            for ( size_t i = 0; i < size; ++i )
+                sum += static_cast< const uint8_t * >( data )[ i ];
+            return sum == 0;
+        }
+
+        // the length is in the header, so it is mapped on its own first
+        const header * map( uint64_t addr ) {
+            using mem::palloc;
+
+            mem::phys::address_t phys = addr;
+            if ( phys != addr )
+                return nullptr;
+
+            auto head = palloc.map_physical( phys, sizeof( header ) );
+            if ( !head )
+                return nullptr;
+            size_t length = reinterpret_cast< const header * >( head )->length;
+            palloc.unmap_physical( head, sizeof( header ) );
+
+            if ( length < sizeof( header ) )
+                return nullptr;
+            return reinterpret_cast< const header * >( palloc.map_physical( phys, length ) );
+        }
+    } // anonymous namespace
+
+    bool init( const multiboot::info & info ) {
+        const rsdp * root = nullptr;
+
+        // the new tag carries the ACPI 2.0 pointer with the XSDT
+        auto take = [&] ( const auto & item ) {
+            if ( !root )
+                root = reinterpret_cast< const rsdp * >( item + 1 );
+        };
+        info.yield( multiboot::information_type::acpi_new, take );
+        info.yield( multiboot::information_type::acpi_old, take );
+
+        if ( !root || memcmp( root->signature, "RSD PTR ", 8 ) != 0 || !valid( root, 20 ) )
+            return false;
+
+        rsdt = root->rsdt;
+        if ( root->revision >= 2 && valid( root, root->length ) )
+            xsdt = root->xsdt;
+        return true;
+    }
+
+    const header * find( const char * signature ) {
+        bool wide = xsdt != 0;
+        if ( !wide && !rsdt )
+            return nullptr;
+
+        auto root = map( wide ? xsdt : rsdt );
+        if ( !root )
+            return nullptr;
+
+        size_t entry_size = wide ? sizeof( uint64_t ) : sizeof( uint32_t );
+        size_t num = ( root->length - sizeof( header ) ) / entry_size;
+        auto entries = reinterpret_cast< const uint8_t * >( root + 1 );
+
+        const header * found = nullptr;
+        for ( size_t i = 0; i < num && !found; ++i ) {
+            // XSDT entries are not 8 byte aligned
+            uint64_t addr = 0;
+            memcpy( &addr, entries + i * entry_size, entry_size );
+
+            auto table = map( addr );
+            if ( !table )
+                continue;
+
+            if ( memcmp( table->signature, signature, 4 ) == 0 && valid( table, table->length ) )
+                found = table;
+            else
+                release( table );
+        }
+
+        release( root );
+        return found;
+    }
+
+    void release( const header * table ) {
+        mem::palloc.unmap_physical( reinterpret_cast< mem::virt::address_t >( table ), table->length );
+    }
+
+} // namespace kernel::acpi
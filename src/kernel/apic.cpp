@@ -0,0 +1,217 @@
+#include <kernel/apic.hpp>
+#include <kernel/acpi.hpp>
+#include <kernel/cpu.hpp>
+#include <kernel/mem.hpp>
+#include <kernel/ioport.hpp>
+#include <kernel/dt.hpp>
+
+namespace kernel::apic {
+
+    volatile uint32_t * local;
+
+    uint8_t cpus[ max_cpus ];
+    size_t num_of_cpus;
+
+    namespace {
+        constexpr uint32_t base_msr = 0x1B;
+        constexpr uint64_t base_enable = 1 << 11;
+        constexpr uint32_t software_enable = 0x100;
+
+        // redirection entry bits, the destination is in the upper half
+        constexpr uint32_t active_low = 1 << 13;
+        constexpr uint32_t level = 1 << 15;
+        constexpr uint32_t masked = 1 << 16;
+
+        // MADT override flags
+        constexpr uint16_t polarity_low = 0x3;
+        constexpr uint16_t trigger_level = 0xC;
+
+        // Registers are reached through a select and a window register.
+        struct io_apic {
+            volatile uint32_t * base;
+            uint32_t gsi_base;
+            uint32_t inputs;
+
+            uint32_t read( uint32_t reg ) {
+                base[ 0 ] = reg;
+                return base[ 4 ];
+            }
+
+            void write( uint32_t reg, uint32_t val ) {
+                base[ 0 ] = reg;
+                base[ 4 ] = val;
+            }
+
+            static constexpr uint32_t entry( uint32_t input ) { return 0x10 + 2 * input; }
+        };
+
+        io_apic io_apics[ max_io_apics ];
+        size_t num_of_io_apics;
+
+        // how the ISA interrupts are wired, identity unless the MADT overrides it
+        struct isa_irq {
+            uint32_t gsi;
+            uint16_t flags;
+            bool overridden;
+        };
+
+        isa_irq isa[ 16 ];
+
+        io_apic * io_apic_of( uint32_t gsi ) {
+            for ( size_t i = 0; i < num_of_io_apics; ++i ) {
+                auto & io = io_apics[ i ];
+                if ( gsi >= io.gsi_base && gsi < io.gsi_base + io.inputs )
+                    return &io;
+            }
+            return nullptr;
+        }
+
+        // ISA interrupts are active high and edge triggered unless overridden,
+        // anything else is PCI, active low and level triggered
+        uint32_t polarity_and_trigger( uint32_t gsi ) {
+            for ( auto & irq : isa ) {
+                if ( irq.gsi != gsi )
+                    continue;
+                uint32_t bits = 0;
+                if ( ( irq.flags & polarity_low ) == polarity_low )
+                    bits |= active_low;
+                if ( ( irq.flags & trigger_level ) == trigger_level )
+                    bits |= level;
+                return bits;
+            }
+            return active_low | level;
+        }
+
+        void set_mask( uint32_t gsi, bool mask ) {
+            auto io = io_apic_of( gsi );
+            if ( !io )
+                return;
+
+            auto reg = io_apic::entry( gsi - io->gsi_base );
+            auto low = io->read( reg );
+            io->write( reg, mask ? low | masked : low & ~masked );
+        }
+
+        uint8_t local_id() {
+            return local[ reg::id / 4 ] >> 24;
+        }
+
+        void parse( const acpi::madt * table, uint64_t & lapic ) {
+            using mem::palloc;
+            using entry = acpi::madt::entry;
+
+            table->yield( [&] ( const entry * item ) {
+                switch ( item->type ) {
+                    case entry::local_apic: {
+                        auto cpu = static_cast< const acpi::madt::local_apic * >( item );
+                        if ( ( cpu->flags & 0x1 ) && num_of_cpus < max_cpus )
+                            cpus[ num_of_cpus++ ] = cpu->apic_id;
+                        break;
+                    }
+                    case entry::io_apic: {
+                        auto io = static_cast< const acpi::madt::io_apic * >( item );
+                        if ( num_of_io_apics == max_io_apics )
+                            break;
+                        auto base = palloc.map_physical( io->address, 0x20, mem::page_allocator::kernel_flags | mem::page_allocator::uncached );
+                        if ( base )
+                            io_apics[ num_of_io_apics++ ] = { reinterpret_cast< volatile uint32_t * >( base ), io->gsi_base, 0 };
+                        break;
+                    }
+                    case entry::source_override: {
+                        auto over = static_cast< const acpi::madt::source_override * >( item );
+                        if ( over->bus == 0 && over->source < 16 )
+                            isa[ over->source ] = { over->gsi, over->flags, true };
+                        break;
+                    }
+                    case entry::lapic_override:
+                        lapic = static_cast< const acpi::madt::lapic_override * >( item )->address;
+                        break;
+                }
+            } );
+        }
+    } // anonymous namespace
+
+    bool init( const multiboot::info & info ) {
+        using mem::palloc;
+
+        if ( !cpu::has( cpu::apic ) || !cpu::has( cpu::msr ) || !acpi::init( info ) )
+            return false;
+
+        auto table = reinterpret_cast< const acpi::madt * >( acpi::find( "APIC" ) );
+        if ( !table )
+            return false;
+
+        for ( uint32_t i = 0; i < 16; ++i )
+            isa[ i ] = { i, 0, false };
+
+        uint64_t lapic = table->lapic;
+        parse( table, lapic );
+        acpi::release( &table->head );
+
+        mem::phys::address_t phys = lapic;
+        if ( !num_of_io_apics || phys != lapic )
+            return false;
+
+        auto regs = palloc.map_physical( phys, mem::paging::page::size, mem::page_allocator::kernel_flags | mem::page_allocator::uncached );
+        if ( !regs )
+            return false;
+
+        uint32_t flags;
+        asm volatile ( "pushf; pop %0; cli" : "=r"( flags ) :: "memory" );
+
+        // the 8259s keep their vectors 32-47, a stray interrupt from them lands somewhere known
+        dev::outb( 0x21, 0xFF );
+        dev::outb( 0xA1, 0xFF );
+
+        cpu::wrmsr( base_msr, cpu::rdmsr( base_msr ) | base_enable );
+        local = reinterpret_cast< volatile uint32_t * >( regs );
+        local[ reg::task_priority / 4 ] = 0;
+        local[ reg::spurious / 4 ] = software_enable | spurious_vector;
+        irq::irq_eoi_register = &local[ reg::eoi / 4 ];
+
+        for ( size_t i = 0; i < num_of_io_apics; ++i ) {
+            auto & io = io_apics[ i ];
+            io.inputs = ( ( io.read( 0x1 ) >> 16 ) & 0xFF ) + 1;
+            for ( uint32_t input = 0; input < io.inputs; ++input )
+                io.write( io_apic::entry( input ), masked );
+        }
+
+        // overrides go last, they win an input shared with an unused ISA line
+        auto boot_cpu = local_id();
+        for ( int pass = 0; pass < 2; ++pass ) {
+            for ( unsigned irq = 0; irq < 16; ++irq ) {
+                if ( isa[ irq ].overridden != ( pass == 1 ) )
+                    continue;
+                route( isa[ irq ].gsi, 32 + irq, boot_cpu );
+                set_mask( isa[ irq ].gsi, false );
+            }
+        }
+
+        asm volatile ( "push %0; popf" :: "r"( flags ) : "memory", "cc" );
+        return true;
+    }
+
+    void route( uint32_t gsi, uint8_t vector, uint8_t cpu ) {
+        auto io = io_apic_of( gsi );
+        if ( !io )
+            return;
+
+        auto reg = io_apic::entry( gsi - io->gsi_base );
+        auto mask = io->read( reg ) & masked;
+        io->write( reg + 1, uint32_t( cpu ) << 24 );
+        io->write( reg, vector | polarity_and_trigger( gsi ) | mask );
+    }
+
+    void mask( unsigned irq ) {
+        set_mask( gsi_of( irq ), true );
+    }
+
+    void unmask( unsigned irq ) {
+        set_mask( gsi_of( irq ), false );
+    }
+
+    uint32_t gsi_of( unsigned irq ) {
+        return irq < 16 ? isa[ irq ].gsi : irq;
+    }
+
+} // namespace kernel::apic
@@ -0,0 +1,138 @@
+#include <kernel/bench.hpp>
+#include <kernel/cpu.hpp>
+#include <kernel/mem.hpp>
+#include <kernel/syscall.hpp>
+#include <kernel/user.hpp>
+
+#include <stdio.h>
+#include <string.h>
+
+// the ring 3 half of syscall_roundtrip, boot.S has it only with THINGY_BENCH
+#ifdef THINGY_BENCH
+extern "C" const char syscall_bench_user[];
+extern "C" const char syscall_bench_user_end[];
+#endif
+
+namespace kernel {
+    namespace bench {
+
+        namespace {
+            constexpr size_t tlb_pages = 256;
+            constexpr size_t tlb_rounds = 1000;
+
+            uint32_t refill_cycles( volatile uint8_t * base ) {
+                using mem::paging::page;
+
+                uint64_t total = 0;
+                for ( size_t r = 0; r < tlb_rounds; ++r ) {
+                    cpu::reload_cr3();
+                    auto begin = cpu::rdtsc();
+                    for ( size_t i = 0; i < tlb_pages; ++i )
+                        base[ i * page::size ];
+                    total += cpu::rdtsc() - begin;
+                }
+                return total / tlb_rounds;
+            }
+        } // anonymous namespace
+
+        void tlb_refill() {
+            if ( !cpu::has( cpu::tsc ) || !cpu::has( cpu::pge ) ) {
+                puts( "bench tlb_refill skipped=1" );
+                return;
+            }
+
+            auto pages = mem::palloc.alloc( tlb_pages );
+            if ( !pages.num ) {
+                puts( "bench tlb_refill skipped=1" );
+                return;
+            }
+
+            auto base = reinterpret_cast< volatile uint8_t * >( pages.addr );
+            auto cr4 = cpu::cr4::get();
+
+            cpu::cr4::set( cr4 & ~cpu::cr4::pge );
+            auto local = refill_cycles( base );
+            cpu::cr4::set( cr4 | cpu::cr4::pge );
+            auto global = refill_cycles( base );
+            cpu::cr4::set( cr4 );
+
+            printf( "bench tlb_refill pages=%u rounds=%u local=%u global=%u\n",
+                    unsigned( tlb_pages ), unsigned( tlb_rounds ), local, global );
+
+            mem::palloc.free( pages );
+        }
+
+#ifdef THINGY_BENCH
+        namespace {
+            constexpr uint32_t syscall_rounds = 10000;
+
+            // the user half reports here and is done
+            constexpr uint32_t results_call = syscall::num_of_calls - 1;
+
+            struct {
+                uint32_t gate;
+                uint32_t fast;
+            } syscall_cycles;
+
+            int syscall_results( uint32_t gate, uint32_t fast, uint32_t ) {
+                syscall_cycles = { gate, fast };
+                user::leave( 0 );
+            }
+        } // anonymous namespace
+
+        void syscall_roundtrip() {
+            using mem::palloc;
+            using mem::paging::page;
+
+            if ( !cpu::has( cpu::tsc ) ) {
+                puts( "bench syscall skipped=1" );
+                return;
+            }
+
+            auto previous = palloc.current;
+            auto space = mem::address_space::create();
+            if ( !space ) {
+                puts( "bench syscall skipped=1" );
+                return;
+            }
+            space->activate();
+
+            auto code = palloc.alloc( 1, true );
+            auto stack = palloc.alloc( 1, true );
+            if ( code.num && stack.num ) {
+                memcpy( reinterpret_cast< void * >( code.addr ), syscall_bench_user, syscall_bench_user_end - syscall_bench_user );
+
+                auto args = reinterpret_cast< uint32_t * >( stack.addr + page::size ) - 4;
+                args[ 0 ] = syscall_rounds;
+                args[ 1 ] = syscall::fast() ? syscall_rounds : 0;
+                args[ 2 ] = syscall::nr::nop;
+                args[ 3 ] = results_call;
+
+                syscall::install( results_call, syscall_results );
+                user::enter( reinterpret_cast< void * >( code.addr ), args );
+                syscall::uninstall( results_call );
+
+                if ( syscall::fast() )
+                    printf( "bench syscall rounds=%u int80=%u sysenter=%u\n", syscall_rounds,
+                            syscall_cycles.gate / syscall_rounds, syscall_cycles.fast / syscall_rounds );
+                else
+                    printf( "bench syscall rounds=%u int80=%u sysenter=skipped\n", syscall_rounds,
+                            syscall_cycles.gate / syscall_rounds );
+            } else {
+                puts( "bench syscall skipped=1" );
+            }
+
+            previous->activate();
+            space->destroy();
+        }
+#endif
+
+        void run() {
+            tlb_refill();
+#ifdef THINGY_BENCH
+            syscall_roundtrip();
+#endif
+        }
+
+    } // namespace bench
+} // namespace kernel
@@ -0,0 +1,112 @@
+#include <kernel/deferred.hpp>
+#include <kernel/cpu.hpp>
+
+#include <stdio.h>
+
+volatile uint32_t deferred_pending;
+
+namespace kernel::deferred {
+
+    counters count[ idt::size ];
+
+    namespace {
+        // newest first, run reverses them
+        work * pending[ idt::size ];
+        uint32_t pending_vectors[ idt::size / 32 ];
+
+        // a nested interrupt leaves its work to the run already going
+        bool running;
+
+        void run_list( unsigned vector ) {
+            work * list = __atomic_exchange_n( &pending[ vector ], nullptr, __ATOMIC_ACQ_REL );
+
+            work * fifo = nullptr;
+            while ( list ) {
+                auto next = list->next;
+                list->next = fifo;
+                fifo = list;
+                list = next;
+            }
+
+            auto & c = count[ vector ];
+            while ( fifo ) {
+                auto item = fifo;
+                fifo = fifo->next;
+
+                uint64_t cycles = cpu::rdtsc() - item->since;
+                c.cycles += cycles;
+                if ( cycles > c.max_cycles )
+                    c.max_cycles = cycles;
+                ++c.run;
+                __atomic_sub_fetch( &c.depth, 1, __ATOMIC_RELAXED );
+
+                // it may queue itself again from here on
+                __atomic_store_n( &item->queued, false, __ATOMIC_RELEASE );
+                item->fn( item );
+            }
+        }
+    } // anonymous namespace
+
+    bool queue( unsigned vector, work * item ) {
+        if ( __atomic_exchange_n( &item->queued, true, __ATOMIC_ACQ_REL ) )
+            return false;
+
+        item->since = cpu::rdtsc();
+        auto head = __atomic_load_n( &pending[ vector ], __ATOMIC_RELAXED );
+        do {
+            item->next = head;
+        } while ( !__atomic_compare_exchange_n( &pending[ vector ], &head, item, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+
+        auto & c = count[ vector ];
+        ++c.queued;
+        auto depth = __atomic_add_fetch( &c.depth, 1, __ATOMIC_RELAXED );
+        if ( depth > c.max_depth )
+            c.max_depth = depth;
+
+        __atomic_fetch_or( &pending_vectors[ vector / 32 ], 1u << ( vector % 32 ), __ATOMIC_RELEASE );
+        __atomic_store_n( &deferred_pending, 1, __ATOMIC_RELEASE );
+        return true;
+    }
+
+    void report() {
+        for ( size_t v = 0; v < idt::size; ++v ) {
+            auto & c = count[ v ];
+            if ( !c.queued )
+                continue;
+            printf( "irq deferred vector=%u queued=%llu run=%llu depth=%u max_depth=%u avg_cycles=%llu max_cycles=%llu\n",
+                    unsigned( v ), static_cast< unsigned long long >( c.queued ), static_cast< unsigned long long >( c.run ),
+                    unsigned( c.depth ), unsigned( c.max_depth ),
+                    static_cast< unsigned long long >( c.run ? c.cycles / c.run : 0 ),
+                    static_cast< unsigned long long >( c.max_cycles ) );
+        }
+    }
+
+} // namespace kernel::deferred
+
+// Called by the IRQ path with interrupts off, returns with them off again.
+extern "C" void deferred_run() {
+    using namespace kernel::deferred;
+
+    if ( running )
+        return;
+    running = true;
+
+    // A nested interrupt may queue work after the last exchange and leave
+    // it to this run, so look again once interrupts are off.
+    do {
+        asm volatile ( "sti" ::: "memory" );
+        while ( __atomic_exchange_n( &deferred_pending, 0, __ATOMIC_ACQ_REL ) ) {
+            for ( size_t w = 0; w < kernel::idt::size / 32; ++w ) {
+                auto vectors = __atomic_exchange_n( &pending_vectors[ w ], 0, __ATOMIC_ACQ_REL );
+                while ( vectors ) {
+                    unsigned bit = __builtin_ctz( vectors );
+                    vectors &= vectors - 1;
+                    run_list( w * 32 + bit );
+                }
+            }
+        }
+        asm volatile ( "cli" ::: "memory" );
+    } while ( __atomic_load_n( &deferred_pending, __ATOMIC_ACQUIRE ) );
+
+    running = false;
+}
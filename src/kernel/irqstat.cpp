@@ -0,0 +1,106 @@
+#include <kernel/irqstat.hpp>
+#include <kernel/cpu.hpp>
+
+#include <stdio.h>
+#include <string.h>
+
+namespace kernel::irq::stats {
+
+    vector vectors[ idt::size ];
+
+    namespace {
+        uint64_t window_start;
+
+        void histogram( const char * name, unsigned v, const uint32_t * h ) {
+            printf( "irq %s vector=%u", name, v );
+            for ( size_t b = 0; b < buckets; ++b )
+                if ( h[ b ] )
+                    printf( " b%u=%u", unsigned( b ), unsigned( h[ b ] ) );
+            printf( "\n" );
+        }
+
+        unsigned long long ull( uint64_t val ) {
+            return val;
+        }
+    } // anonymous namespace
+
+    void reset() {
+        memset( vectors, 0, sizeof( vectors ) );
+        window_start = cpu::rdtsc();
+    }
+
+    void report() {
+        if ( !enabled ) {
+            puts( "irq stats disabled=1" );
+            return;
+        }
+
+        uint64_t window = cpu::rdtsc() - window_start;
+        for ( size_t v = 0; v < idt::size; ++v ) {
+            auto & s = vectors[ v ];
+            if ( !s.count )
+                continue;
+
+            printf( "irq vector=%u count=%llu window=%llu avg_cycles=%llu max_cycles=%llu\n", unsigned( v ),
+                    ull( s.count ), ull( window ), ull( s.cycles / s.count ), ull( s.max_cycles ) );
+            histogram( "handler", v, s.handler );
+            histogram( "disabled", v, s.disabled );
+        }
+    }
+
+} // namespace kernel::irq::stats
+
+#ifdef THINGY_IRQ_STATS
+namespace kernel::irq::stats {
+
+    namespace {
+        // Entry times of the interrupts in progress. An exception in a
+        // handler or an IRQ during deferred work nests, the hooks of one
+        // interrupt run with interrupts off.
+        constexpr size_t max_nesting = 8;
+        uint64_t entered[ max_nesting ];
+        size_t depth;
+
+        uint64_t since_entry() {
+            return cpu::rdtsc() - entered[ ( depth < max_nesting ? depth : max_nesting ) - 1 ];
+        }
+
+        size_t bucket( uint64_t cycles ) {
+            size_t b = cycles <= 1 ? 0 : 63 - __builtin_clzll( cycles );
+            return b < buckets ? b : buckets - 1;
+        }
+    } // anonymous namespace
+
+} // namespace kernel::irq::stats
+
+// Hooks of the interrupt stubs: enter first thing, exit after the
+// handler, leave right before interrupts are enabled again.
+extern "C" {
+    void irq_stats_enter( unsigned ) {
+        using namespace kernel::irq::stats;
+
+        // deeper nesting is not timed, its exit and leave see the outer entry
+        if ( depth < max_nesting )
+            entered[ depth ] = kernel::cpu::rdtsc();
+        ++depth;
+    }
+
+    void irq_stats_exit( unsigned v ) {
+        using namespace kernel::irq::stats;
+
+        uint64_t cycles = since_entry();
+        auto & s = vectors[ v ];
+        ++s.count;
+        s.cycles += cycles;
+        if ( cycles > s.max_cycles )
+            s.max_cycles = cycles;
+        ++s.handler[ bucket( cycles ) ];
+    }
+
+    void irq_stats_leave( unsigned v ) {
+        using namespace kernel::irq::stats;
+        ++vectors[ v ].disabled[ bucket( since_entry() ) ];
+        --depth;
+    }
+}
+#endif
@@ -2,6 +2,9 @@
 #include <kernel/dt.hpp>
 #include <kernel/panic.hpp>
 #include <kernel/dev.hpp>
+#include <kernel/cpu.hpp>
+#include <kernel/memstat.hpp>
+#include <kernel/wss.hpp>
 
 #include <string.h>
 #include <stdio.h>
@@ -18,15 +21,12 @@ namespace {
 
 } // anonymous namespace
 
-extern "C" {
-    uintptr_t kernel_stack;
-}
+extern uint32_t tss[ 26 ];
 
 namespace kernel::mem {
 
-
     void set_kernel_stack( uintptr_t stack ) {
-        kernel_stack = stack;
+        tss[ 1 ] = stack; // ESP0
     }
 
     namespace {
@@ -41,7 +41,11 @@ namespace kernel::mem {
             }
 
             static void set( page_directory * dir ) {
+#ifdef THINGY_PAE
+                auto addr = reinterpret_cast< uint32_t >( &dir->pdpt[0] );
+#else
                 auto addr = reinterpret_cast< uint32_t >( &dir->tables[0] );
+#endif
                 asm volatile ("movl %%eax, %%cr3" :: "a" (addr));
             }
         };
@@ -57,21 +61,38 @@ namespace kernel::mem {
                 asm volatile ("movl %%eax, %%cr0" :: "a" (val));
             }
         };
+
+        // frames below direct_end are identity mapped
+        phys::address_t direct_end;
+
+        // kernel page to look at the other frames through
+        virt::address_t window;
+
+        void * map_window( phys::address_t phys ) {
+            if ( phys < direct_end )
+                return phys_2_virt( phys );
+
+            palloc.map( phys, window, page_allocator::kernel_flags );
+            palloc.flush( window, 1, true );
+            return reinterpret_cast< void * >( window );
+        }
     }
 
 	namespace paging {
 		page_directory * kernel_page_dir;
 
-        page_table * get_table( virt::address_t addr ) {
-            return kernel_page_dir->tables[ ( addr >> 20 ) & ~0x3 ];
+        // a large page has no table to look into
+        bool table_present( virt::address_t addr ) {
+            auto dir = get_dir_entry( addr );
+            return dir.present && !( dir.raw & page_entry::large );
         }
 
-        size_t page_idx( virt::address_t addr ) {
-            return ( addr >> 12 ) & (( 1 << 12 ) - 1 );
+        page_table * get_table( virt::address_t addr ) {
+            return reinterpret_cast< page_table * >( tables_base + dir_index( addr ) * page::size );
         }
 
-        page_entry & get_page( virt::address_t addr ) {
-            return get_table( addr )->pages[ page_idx( addr ) ];
+        size_t page_idx( virt::address_t addr ) {
+            return ( addr >> 12 ) & ( page_table::size - 1 );
         }
 
         size_t offset( virt::address_t addr ) {
@@ -79,180 +100,698 @@ namespace kernel::mem {
         }
 
         void switch_page_dir( page_directory * dir ) {
+            constexpr uint32_t paging = 0x80000000, write_protect = 0x10000;
+
             cr3::set( dir );
-            cr0::set( cr0::get() | 0x80000000 );
+            // the kernel has to fault on read-only pages too, or it would write into shared frames
+            cr0::set( cr0::get() | paging | write_protect );
         }
 
-        void page_fault_handler( registers_t * ) {
+        void page_fault_handler( registers_t * regs ) {
             uint32_t faulting_address;
             asm volatile( "mov %%cr2, %0" : "=r"( faulting_address ) );
 
+            constexpr uint32_t protection = 0x1, write = 0x2, from_user = 0x4;
+
+            ++stats::count.page_faults;
+
+            if ( ( regs->err_code & protection ) && ( regs->err_code & write ) && table_present( faulting_address ) ) {
+                auto & entry = get_page( faulting_address );
+                bool allowed = entry.user || !( regs->err_code & from_user );
+
+                if ( ( entry.raw & page_entry::cow ) && allowed ) {
+                    phys::address_t phys = entry.addr();
+                    ++stats::count.cow_faults;
+
+                    // somebody else still maps the frame, take a private copy
+                    if ( falloc.unshare( phys ) ) {
+                        auto frame = falloc.alloc();
+                        if ( !frame.valid() ) {
+                            fprintf( stderr, "Out of memory copying 0x%x\n", faulting_address );
+                            panic();
+                        }
+
+                        memcpy( phys_2_virt( frame.addr ), map_window( phys ), page::size );
+                        phys = frame.addr;
+                        ++stats::count.cow_copies;
+                    }
+
+                    entry.raw = phys | ( entry.raw & 0xfff & ~page_entry::cow ) | 0x2;
+                    asm volatile( "invlpg (%0)" :: "r"( faulting_address ) : "memory" );
+                    return;
+                }
+            }
+
+            if ( !( regs->err_code & protection ) && table_present( faulting_address ) ) {
+                auto & entry = get_page( faulting_address );
+                bool allowed = entry.user || !( regs->err_code & from_user );
+
+                if ( ( entry.raw & page_entry::demand_zero ) && allowed ) {
+                    ++stats::count.demand_zero_faults;
+                    auto frame = falloc.alloc_zeroed();
+                    if ( !frame.valid() ) {
+                        fprintf( stderr, "Out of memory backing 0x%x\n", faulting_address );
+                        panic();
+                    }
+
+                    entry.raw = frame.addr | ( entry.raw & 0xfff & ~page_entry::demand_zero ) | 0x1;
+                    return;
+                }
+            }
+
             fprintf( stderr, "Page fault at 0x%x\n", faulting_address );
             panic();
         }
 
 		page_table * page_table::create() {
-            page_table * tab = reinterpret_cast< page_table * >( kmalloc_page_aligned( sizeof( page_table ) ) );
-            for ( size_t i = 0; i < page_table::size; i++ ) {
-                tab->pages[ i ].present = 0;
-                tab->pages[ i ].rw = 1;
+            auto frame = falloc.alloc_zeroed();
+            if ( !frame.valid() ) {
+                fprintf( stderr, "Out of physical memory\n" );
+                panic();
             }
 
-            return tab;
-        }
-
-		page_table * page_table::empty() {
-            return reinterpret_cast< page_table * >( 0x00000002 );
+            return reinterpret_cast< page_table * >( phys_2_virt( frame.addr ) );
         }
 
 		page_directory * page_directory::create() {
-            auto dir = reinterpret_cast< page_directory * >( kmalloc_page_aligned( sizeof( page_directory ) ) );
+            auto frame = falloc.alloc( directory_frames );
+            if ( !frame.valid() ) {
+                fprintf( stderr, "Out of physical memory\n" );
+                panic();
+            }
 
-            for ( size_t i = 0; i < page_directory::size; i++ )
-                dir->tables[ i ] = page_table::empty();
+            auto dir = reinterpret_cast< page_directory * >( phys_2_virt( frame.addr ) );
+
+            // the kernel part is shared, its tables never change after init
+            constexpr size_t kernel_tables = dir_index( virt::kernel_end );
+            for ( size_t i = 0; i < page_directory::size; i++ ) {
+                if ( kernel_page_dir && i < kernel_tables )
+                    dir->tables[ i ] = kernel_page_dir->tables[ i ];
+                else
+                    dir->tables[ i ].raw = 0;
+            }
+
+            // the directory maps itself as the tables above tables_base
+            constexpr size_t self = dir_index( tables_base );
+            for ( size_t i = 0; i < sizeof( dir->tables ) / page::size; ++i )
+                dir->tables[ self + i ].raw = ( frame.addr + i * page::size ) | 0x3;
+
+#ifdef THINGY_PAE
+            for ( size_t i = 0; i < 4; ++i )
+                dir->pdpt[ i ] = reinterpret_cast< uint32_t >( &dir->tables[ i * page_table::size ] ) | 0x1;
+#endif
 
             return dir;
         }
 	} // namespace paging
 
     void identity_map_page( page_directory * dir, virt::address_t virt, phys::address_t phys ) {
-        short id = virt >> 22;
-
         auto tab = page_table::create();
-        dir->tables[ id ] = reinterpret_cast< page_table * >(
-            reinterpret_cast< uint32_t >( tab ) | 0x3 );
+        dir->tables[ paging::dir_index( virt ) ].raw = reinterpret_cast< uint32_t >( tab ) | 0x3;
 
         for ( size_t i = 0; i < page_table::size; i++ ) {
             tab->pages[ i ].frame = phys >> 12;
             tab->pages[ i ].present = 1;
+            tab->pages[ i ].rw = 1;
+            tab->pages[ i ].global = 1;
             phys += 4096;
         }
     }
 
+    void identity_map_large( page_directory * dir, virt::address_t virt ) {
+        dir->tables[ paging::dir_index( virt ) ].raw = virt | paging::page_entry::large | 0x103;
+    }
+
     frame_allocator falloc;
 
     void * kmalloc_page_aligned( size_t size ) {
         if ( size > paging::page::size )
             panic();
-        return reinterpret_cast< void * >( falloc.alloc().addr );
+
+        auto frame = falloc.alloc();
+        if ( !frame.valid() ) {
+            fprintf( stderr, "Out of physical memory\n" );
+            panic();
+        }
+
+        return phys_2_virt( frame.addr );
     }
 
     namespace {
-        static constexpr size_t num_of_pages = 0x4000000;
+        // the most physical memory the kernel identity maps
+        static constexpr uint64_t direct_map_limit = 0x30000000;
 
+        // Used frames have their bit set. Each summary bit tells whether
+        // the corresponding word still has a free frame, so searches skip
+        // 1024 used frames per summary word.
         struct frame_bitmap {
+            static constexpr size_t bits = 32;
+            static constexpr size_t npos = ~size_t( 0 );
 
-            static constexpr size_t size = num_of_pages / 8;
+            static constexpr size_t words( size_t frames ) {
+                return ( frames + bits - 1 ) / bits;
+            }
 
-            size_t offset( size_t idx ) {
-                return 7 - ( idx % 8 );
+            static constexpr size_t bytes( size_t frames ) {
+                return ( words( frames ) + words( words( frames ) ) ) * sizeof( uint32_t );
+            }
+
+            static uint32_t mask( size_t from, size_t to ) {
+                return ( to == bits ? ~0u : ( 1u << to ) - 1 ) & ( ~0u << from );
+            }
+
+            void init( uint32_t * storage, size_t frames ) {
+                size = frames;
+                num_of_words = words( frames );
+                word = storage;
+                summary = storage + num_of_words;
+
+                memset( word, 0xff, num_of_words * sizeof( uint32_t ) );
+                memset( summary, 0, words( num_of_words ) * sizeof( uint32_t ) );
+            }
+
+            void update_summary( size_t w ) {
+                if ( word[ w ] == ~0u )
+                    summary[ w / bits ] &= ~( 1u << ( w % bits ) );
+                else
+                    summary[ w / bits ] |= 1u << ( w % bits );
             }
 
             bool get( size_t idx ) {
-                return bitmap[ idx / 8 ] & ( 1 << offset( idx ) );
+                return word[ idx / bits ] & ( 1u << ( idx % bits ) );
             }
 
             void set( size_t idx ) {
-                bitmap[ idx / 8 ] = bitmap[ idx / 8 ] | ( 1 << offset( idx ) );
+                set_range( idx, idx + 1 );
             }
 
             void reset( size_t idx ) {
-                bitmap[ idx / 8 ] = bitmap[ idx / 8 ] & ~( 1 << offset( idx ) );
+                reset_range( idx, idx + 1 );
+            }
+
+            template< typename Fn >
+            void for_each_word( size_t begin, size_t end, Fn fn ) {
+                while ( begin < end ) {
+                    size_t w = begin / bits;
+                    size_t to = end - w * bits < bits ? end - w * bits : bits;
+                    fn( w, mask( begin % bits, to ) );
+                    begin = ( w + 1 ) * bits;
+                }
             }
 
-            char bitmap [ size ];
+            void set_range( size_t begin, size_t end ) {
+                for_each_word( begin, end, [&] ( size_t w, uint32_t m ) {
+                    word[ w ] |= m;
+                    update_summary( w );
+                } );
+            }
+
+            void reset_range( size_t begin, size_t end ) {
+                for_each_word( begin, end, [&] ( size_t w, uint32_t m ) {
+                    word[ w ] &= ~m;
+                    update_summary( w );
+                } );
+            }
+
+            bool all_set( size_t begin, size_t end ) {
+                bool result = true;
+                for_each_word( begin, end, [&] ( size_t w, uint32_t m ) {
+                    result = result && ( word[ w ] & m ) == m;
+                } );
+                return result;
+            }
+
+            // first free frame at or after idx, npos if there is none
+            size_t find_free( size_t idx ) {
+                size_t w = idx / bits;
+                if ( w >= num_of_words )
+                    return npos;
+
+                if ( uint32_t free = ~word[ w ] & ( ~0u << ( idx % bits ) ) )
+                    return w * bits + __builtin_ctz( free );
+
+                size_t s = ++w / bits;
+                size_t num_of_summaries = words( num_of_words );
+                if ( s >= num_of_summaries )
+                    return npos;
+
+                uint32_t candidates = summary[ s ] & ( ~0u << ( w % bits ) );
+                while ( !candidates ) {
+                    if ( ++s >= num_of_summaries )
+                        return npos;
+                    candidates = summary[ s ];
+                }
+
+                w = s * bits + __builtin_ctz( candidates );
+                return w * bits + __builtin_ctz( ~word[ w ] );
+            }
+
+            // first used frame at or after idx, size if the rest is free
+            size_t find_used( size_t idx ) {
+                size_t w = idx / bits;
+                if ( w >= num_of_words )
+                    return size;
+
+                uint32_t used = word[ w ] & ( ~0u << ( idx % bits ) );
+                while ( !used ) {
+                    if ( ++w >= num_of_words )
+                        return size;
+                    used = word[ w ];
+                }
+
+                size_t found = w * bits + __builtin_ctz( used );
+                return found < size ? found : size;
+            }
+
+            uint32_t * word;
+            uint32_t * summary;
+            size_t num_of_words;
+            size_t size;
         };
 
         frame_bitmap fbitmap;
+
+        struct frame_info {
+            enum flag : uint8_t {
+                slab = 0x1,
+                boot = 0x2,     // kernel image, multiboot information or a module
+                shared = 0x4,   // holds parts of more than one boot range
+                head = 0x8,     // first frame of a free block linked in a free list
+            };
+
+            uint32_t next;
+            uint32_t prev;
+            uint16_t refs;  // mappings besides the first one, see address_space::clone
+            uint8_t order;
+            uint8_t flags;
+        };
+
+        frame_info * frames;
+
+        // frames up to the top of usable memory, set from the memory map
+        size_t num_of_frames = 0;
+
+        frame_allocator::zone zone_of( size_t idx ) {
+            return idx < paging::page::index( direct_end ) ? frame_allocator::direct : frame_allocator::high;
+        }
+
+        size_t order_of( size_t num ) {
+            return num <= 1 ? 0 : 32 - __builtin_clz( num - 1 );
+        }
+
+        // largest block order that is aligned at idx and fits into num frames
+        size_t block_order( size_t idx, size_t num ) {
+            size_t order = 0;
+            while ( order < frame_allocator::max_order
+                    && idx % ( 2 << order ) == 0
+                    && ( 2u << order ) <= num )
+                ++order;
+            return order;
+        }
+
+        uint64_t page_align_up( uint64_t addr ) {
+            return ( addr + paging::page::size - 1 ) & ~uint64_t( paging::page::size - 1 );
+        }
+
+        uint64_t page_align_down( uint64_t addr ) {
+            return addr & ~uint64_t( paging::page::size - 1 );
+        }
+
+        template< typename Fn >
+        void for_each_region( const multiboot::info & info, Fn fn ) {
+            info.yield( multiboot::information_type::memory_map, [&] ( const auto & item ) {
+                auto mmap = reinterpret_cast< multiboot_tag_mmap * >( item );
+
+                auto next_entry = [mmap] ( const auto & entry ) {
+                    return reinterpret_cast< multiboot_memory_map_t * >(
+                           reinterpret_cast< uintptr_t >( entry ) + mmap->entry_size );
+                };
+
+                auto is_end = [mmap] ( const auto & entry ) {
+                    auto mmap_end = reinterpret_cast< uintptr_t >( mmap ) + mmap->size;
+                    return reinterpret_cast< uintptr_t >( entry ) >= mmap_end;
+                };
+
+                for ( auto entry = mmap->entries; !is_end( entry ); entry = next_entry( entry ) )
+                    fn( entry );
+            } );
+        }
+
+        // calls fn( begin, end ) for every range that holds boot data still in use
+        template< typename Fn >
+        void for_each_boot_range( const multiboot::info & info, Fn fn ) {
+            fn( reinterpret_cast< uint64_t >( &__kernel_start ),
+                reinterpret_cast< uint64_t >( &__kernel_end ) );
+
+            fn( info.address(), info.address() + info.size() );
+
+            info.yield( multiboot::information_type::module, [&] ( const auto & item ) {
+                auto mod = reinterpret_cast< multiboot::modules_information * >( item );
+                fn( mod->start, mod->end );
+            } );
+        }
+
+        uint64_t top_of_memory( const multiboot::info & info ) {
+            uint64_t top = 0;
+            for_each_region( info, [&] ( const auto & entry ) {
+                if ( entry->type == MULTIBOOT_MEMORY_AVAILABLE && entry->addr + entry->len > top )
+                    top = entry->addr + entry->len;
+            } );
+
+#ifndef THINGY_PAE
+            // without PAE nothing above 4 GiB can be mapped
+            if ( top > uint64_t( 1 ) << 32 )
+                top = uint64_t( 1 ) << 32;
+#endif
+            return page_align_down( top );
+        }
+
+        // Finds room for size bytes in the first usable region above 1 MiB,
+        // stepping over the kernel image, the multiboot information and modules.
+        uint64_t find_boot_storage( const multiboot::info & info, size_t size, uint64_t top ) {
+            uint64_t place = 0;
+
+            for_each_region( info, [&] ( const auto & entry ) {
+                if ( place || entry->type != MULTIBOOT_MEMORY_AVAILABLE )
+                    return;
+
+                uint64_t begin = page_align_up( entry->addr < 0x100000 ? 0x100000 : entry->addr );
+                uint64_t end = entry->addr + entry->len < top ? entry->addr + entry->len : top;
+
+                for ( bool moved = true; moved; ) {
+                    moved = false;
+                    for_each_boot_range( info, [&] ( uint64_t b, uint64_t e ) {
+                        if ( begin < e && b < begin + size ) {
+                            begin = page_align_up( e );
+                            moved = true;
+                        }
+                    } );
+                }
+
+                if ( begin + size <= end )
+                    place = begin;
+            } );
+
+            return place;
+        }
+
+        void mark_used( uint64_t begin, uint64_t end ) {
+            using paging::page;
+            uint64_t top = uint64_t( num_of_frames ) * page::size;
+            end = page_align_up( end ) < top ? page_align_up( end ) : top;
+            begin = page_align_down( begin );
+            if ( begin < end )
+                fbitmap.set_range( page::index( begin ), page::index( end ) );
+        }
     }
 
     void frame_allocator::init( const multiboot::info & info ) {
         using namespace mem::paging;
-        memset( fbitmap.bitmap, 0, frame_bitmap::size );
 
-        auto kernel_start = reinterpret_cast< uint32_t >( &__kernel_start );
-        auto kernel_end = reinterpret_cast< uint32_t >( &__kernel_end );
+        uint64_t top = top_of_memory( info );
+        num_of_frames = top / page::size;
 
-        for ( size_t addr = kernel_start; addr < kernel_end; addr += page::size ) {
-            fbitmap.set( page::index( addr ) );
+        // frames above the identity map form the high zone
+        direct_end = top < direct_map_limit ? top : direct_map_limit;
+
+        size_t bitmap_size = frame_bitmap::bytes( num_of_frames );
+        size_t storage_size = page_align_up( bitmap_size + num_of_frames * sizeof( frame_info ) );
+
+        uint64_t storage = find_boot_storage( info, storage_size, direct_end );
+        if ( !storage ) {
+            fprintf( stderr, "No room for frame allocator metadata\n" );
+            panic();
         }
 
-        info.yield( multiboot::information_type::memory_map, [&] ( const auto & item ) {
-            auto mmap = reinterpret_cast< multiboot_tag_mmap * >( item );
+        // everything is used until the memory map says otherwise
+        fbitmap.init( reinterpret_cast< uint32_t * >( storage ), num_of_frames );
 
-            auto next_entry = [mmap] ( const auto & entry ) {
-                return reinterpret_cast< multiboot_memory_map_t * >(
-                       reinterpret_cast< uintptr_t >( entry ) + mmap->entry_size );
-            };
+        frames = reinterpret_cast< frame_info * >( storage + bitmap_size );
+        memset( frames, 0, num_of_frames * sizeof( frame_info ) );
 
-            auto is_end = [mmap] ( const auto & entry ) {
-                auto mmap_end = reinterpret_cast< uintptr_t >( mmap ) + mmap->size;
-                return reinterpret_cast< uintptr_t >( entry ) >= mmap_end;
-            };
+        for_each_region( info, [&] ( const auto & entry ) {
+            if ( entry->type != MULTIBOOT_MEMORY_AVAILABLE )
+                return;
 
-            for ( auto entry = mmap->entries; !is_end( entry ); entry = next_entry( entry ) ) {
-                if ( entry->type != MULTIBOOT_MEMORY_AVAILABLE ) {
-                    size_t size = entry->addr + entry->len;
-                    for ( size_t addr = entry->addr; addr < size; addr += page::size )
-                        fbitmap.set( page::index( addr ) );
-                }
-            }
+            uint64_t begin = page_align_up( entry->addr );
+            uint64_t end = page_align_down( entry->addr + entry->len );
+            if ( end > top )
+                end = top;
+            if ( begin < end )
+                fbitmap.reset_range( page::index( begin ), page::index( end ) );
+        } );
+
+        // frame 0 is never handed out, null stays an invalid address
+        fbitmap.set( 0 );
+
+        for_each_boot_range( info, [] ( uint64_t begin, uint64_t end ) {
+            mark_used( begin, end );
 
+            for ( auto idx = page::index( begin ); idx < num_of_frames && idx < page::index( page_align_up( end ) ); ++idx ) {
+                if ( frames[ idx ].flags & frame_info::boot )
+                    frames[ idx ].flags |= frame_info::shared;
+                frames[ idx ].flags |= frame_info::boot;
+            }
         } );
+        mark_used( storage, storage + storage_size );
 
         uintptr_t video_addr = 0xB8000;
         size_t video_size = dev::VGA::width * dev::VGA::height * 2;
-        for ( auto fb = video_addr; fb < video_addr + video_size; fb += page::size )
-            fbitmap.set( page::index( fb ) );
-
-        info.yield( multiboot::information_type::module, [] ( const auto & item ) {
-            using namespace mem::paging;
-            auto mod = reinterpret_cast< multiboot::modules_information * >( item );
-            for ( size_t addr = mod->start; addr < mod->end; addr += page::size )
-                fbitmap.set( page::index( addr ) );
-        } );
+        mark_used( video_addr, video_addr + video_size );
+
+        for ( auto & lists : falloc.free_lists )
+            for ( auto & head : lists )
+                head = no_frame;
+        falloc.free_frames = 0;
+        falloc.num_zeroed = 0;
+        falloc.total_frames = num_of_frames;
+
+        for ( size_t idx = fbitmap.find_free( 0 ); idx != frame_bitmap::npos; ) {
+            size_t end = fbitmap.find_used( idx );
+            falloc.release_range( idx, end - idx );
+            falloc.free_frames += end - idx;
+            idx = fbitmap.find_free( end );
+        }
+
+        falloc.reserved_frames = num_of_frames - falloc.free_frames;
     }
 
-    void frame_allocator::skip_allocated_frames() {
-        while ( fbitmap.get( last ) )
-            last = ( last + 1 ) % num_of_pages;
+    void frame_allocator::push( size_t idx, size_t order ) {
+        auto & info = frames[ idx ];
+        info.order = order;
+        info.flags |= frame_info::head;
+        info.prev = no_frame;
+        info.next = free_lists[ zone_of( idx ) ][ order ];
+
+        if ( info.next != no_frame )
+            frames[ info.next ].prev = idx;
+        free_lists[ zone_of( idx ) ][ order ] = idx;
+    }
+
+    void frame_allocator::remove( size_t idx ) {
+        auto & info = frames[ idx ];
+
+        if ( info.prev != no_frame )
+            frames[ info.prev ].next = info.next;
+        else
+            free_lists[ zone_of( idx ) ][ info.order ] = info.next;
+
+        if ( info.next != no_frame )
+            frames[ info.next ].prev = info.prev;
+
+        info.flags &= ~frame_info::head;
+    }
+
+    void frame_allocator::release( size_t idx, size_t order ) {
+        while ( order < max_order ) {
+            size_t buddy = idx ^ ( 1 << order );
+            if ( buddy >= num_of_frames || !( frames[ buddy ].flags & frame_info::head ) || frames[ buddy ].order != order )
+                break;
+
+            remove( buddy );
+            idx &= ~( 1 << order );
+            ++order;
+        }
+
+        push( idx, order );
+    }
+
+    void frame_allocator::release_range( size_t idx, size_t num ) {
+        while ( num > 0 ) {
+            size_t order = block_order( idx, num );
+            release( idx, order );
+            idx += 1 << order;
+            num -= 1 << order;
+        }
     }
 
     frame_allocator::frame frame_allocator::alloc() {
-        return alloc( 1 );
+        auto frame = alloc( 1 );
+
+        // the zeroed pool is still free memory when nothing else is left
+        if ( !frame.valid() && num_zeroed )
+            frame = { zeroed[ --num_zeroed ], 1 };
+        return frame;
+    }
+
+    frame_allocator::frame frame_allocator::alloc_zeroed() {
+        if ( num_zeroed )
+            return { zeroed[ --num_zeroed ], 1 };
+
+        auto frame = alloc( 1 );
+        if ( frame.valid() )
+            memset( phys_2_virt( frame.addr ), 0, paging::page::size );
+        return frame;
     }
 
-    frame_allocator::frame frame_allocator::alloc( size_t num_of_frames ) {
-        bool available = false;
+    bool frame_allocator::prezero() {
+        if ( num_zeroed == zero_pool_size )
+            return false;
 
-        while ( !available ) {
-            skip_allocated_frames();
+        auto frame = alloc( 1 );
+        if ( !frame.valid() )
+            return false;
 
-            available = true;
-            for ( int i = 0; i < num_of_frames; ++i ) {
-                if ( fbitmap.get( ( last + i ) % num_of_pages ) ) {
-                    available = false;
-                    last = last + i;
-                    break;
+        memset( phys_2_virt( frame.addr ), 0, paging::page::size );
+        zeroed[ num_zeroed++ ] = frame.addr;
+        return true;
+    }
+
+    frame_allocator::frame frame_allocator::alloc( size_t num, zone z ) {
+        stats::timed timer( stats::frame_alloc );
+
+        size_t order = order_of( num );
+        if ( num == 0 || order > max_order || num > free_frames )
+            return { 0, 0 };
+
+        size_t current = order;
+        while ( current <= max_order && free_lists[ z ][ current ] == no_frame )
+            ++current;
+
+        if ( current > max_order )
+            return { 0, 0 };
+
+        size_t idx = free_lists[ z ][ current ];
+        remove( idx );
+
+        // split the block, upper halves go back to the lower orders
+        while ( current > order ) {
+            --current;
+            push( idx + ( 1 << current ), current );
+        }
+
+        // give back the tail of the power of two block
+        release_range( idx + num, ( 1 << order ) - num );
+
+        fbitmap.set_range( idx, idx + num );
+        free_frames -= num;
+
+        return { phys::address_t( idx ) * paging::page::size, num };
+    }
+
+    size_t frame_allocator::alloc( size_t num, frame * runs, size_t max_runs ) {
+        size_t count = 0;
+        zone z = high;
+
+        while ( num && num <= free_frames ) {
+            // the biggest block that still fits, smaller ones before splitting
+            size_t order = 31 - __builtin_clz( num );
+            if ( order > max_order )
+                order = max_order;
+
+            size_t current = order;
+            while ( current > 0 && free_lists[ z ][ current ] == no_frame )
+                --current;
+            if ( free_lists[ z ][ current ] == no_frame )
+                current = order;
+
+            auto block = alloc( size_t( 1 ) << current, z );
+            if ( !block.valid() ) {
+                // the direct zone is left for what the kernel touches itself
+                if ( z == high ) {
+                    z = direct;
+                    continue;
                 }
+                break;
+            }
+
+            if ( count && runs[ count - 1 ].addr + runs[ count - 1 ].size * paging::page::size == block.addr ) {
+                runs[ count - 1 ].size += block.size;
+            } else if ( count < max_runs ) {
+                runs[ count++ ] = block;
+            } else {
+                free( block );
+                break;
             }
+
+            num -= block.size;
         }
 
-        phys::address_t addr = paging::page::size * last;
+        return count;
+    }
+
+    frame_allocator::frame frame_allocator::adopt( const multiboot::modules_information & mod ) {
+        using paging::page;
+
+        auto idx = page::index( mod.start );
+        size_t num = ( mod.end - mod.start + page::size - 1 ) / page::size;
+
+        if ( mod.start % page::size || num == 0 || zone_of( idx + num - 1 ) != direct )
+            return { 0, 0 };
+
+        for ( size_t i = idx; i < idx + num; ++i )
+            if ( ( frames[ i ].flags & ( frame_info::boot | frame_info::shared ) ) != frame_info::boot )
+                return { 0, 0 };
 
-        for ( int i = 0; i < num_of_frames; ++i )
-            fbitmap.set( last + i );
-        skip_allocated_frames();
+        for ( size_t i = idx; i < idx + num; ++i )
+            frames[ i ].flags &= ~frame_info::boot;
+        reserved_frames -= num;
 
-        return { addr, num_of_frames };
+        // the rest of the last frame is not part of the module
+        memset( reinterpret_cast< void * >( mod.end ), 0, num * page::size - ( mod.end - mod.start ) );
+
+        return { mod.start, num };
+    }
+
+    void frame_allocator::share( phys::address_t addr ) {
+        auto & info = frames[ paging::page::index( addr ) ];
+        if ( info.refs == uint16_t( ~0 ) )
+            panic();
+        ++info.refs;
+    }
+
+    bool frame_allocator::unshare( phys::address_t addr ) {
+        auto & info = frames[ paging::page::index( addr ) ];
+        if ( info.refs == 0 )
+            return false;
+        --info.refs;
+        return true;
+    }
+
+    size_t frame_allocator::free_blocks( zone z, size_t order ) const {
+        size_t count = 0;
+        for ( auto idx = free_lists[ z ][ order ]; idx != no_frame; idx = frames[ idx ].next )
+            ++count;
+        return count;
     }
 
     void frame_allocator::free( frame_allocator::frame frame ) {
-        for ( int i = 0; i < frame.size; ++i ) {
-            if ( !fbitmap.get( paging::page::index( frame.addr ) + i ) )
+        stats::timed timer( stats::frame_free );
+
+        auto idx = paging::page::index( frame.addr );
+
+        if ( idx + frame.size > num_of_frames || !fbitmap.all_set( idx, idx + frame.size ) )
+            panic();
+
+        // boot frames have to be adopted first
+        for ( size_t i = idx; i < idx + frame.size; ++i )
+            if ( frames[ i ].flags & frame_info::boot )
                 panic();
-            fbitmap.reset( paging::page::index( frame.addr ) + i );
-        }
+
+        fbitmap.reset_range( idx, idx + frame.size );
+        free_frames += frame.size;
+
+        release_range( idx, frame.size );
     }
 
     page_allocator palloc;
@@ -261,180 +800,789 @@ namespace kernel::mem {
         palloc.allocator = allocator;
     }
 
+    namespace {
+        page_table * ensure_table( virt::address_t addr, uint32_t flags ) {
+            using namespace paging;
+
+            auto table = get_table( addr );
+            if ( !table_present( addr ) ) {
+                // the table is only ever touched through tables_base, any frame will do
+                auto frame = falloc.alloc( 1, frame_allocator::high );
+                if ( !frame.valid() )
+                    frame = falloc.alloc();
+                if ( !frame.valid() ) {
+                    fprintf( stderr, "Out of physical memory\n" );
+                    panic();
+                }
+
+                get_dir_entry( addr ).raw = frame.addr | 0x3 | ( flags & 0x4 );
+                asm volatile( "invlpg (%0)" :: "r"( table ) : "memory" );
+                memset( table, 0, page::size );
+
+                if ( addr >= virt::user_begin && addr < virt::user_end )
+                    wss::add_table( *palloc.current, addr );
+            }
+            return table;
+        }
+
+        // calls fn( entry, addr ) for num pages from addr, looking every table
+        // up only once; pages without a table are skipped
+        template< typename Fn >
+        void walk( virt::address_t addr, size_t num, Fn fn ) {
+            using namespace paging;
+
+            while ( num ) {
+                size_t idx = page_idx( addr );
+                size_t count = page_table::size - idx < num ? page_table::size - idx : num;
+
+                if ( table_present( addr ) ) {
+                    auto table = get_table( addr );
+                    for ( size_t i = 0; i < count; ++i )
+                        fn( table->pages[ idx + i ], addr + i * page::size );
+                }
+
+                addr += count * page::size;
+                num -= count;
+            }
+        }
+    } // anonymous namespace
+
     void page_allocator::map( phys::address_t phys, virt::address_t virt, uint32_t flags ) {
+        if ( flags & 0x1 )
+            ++stats::count.mapped_pages;
+        ensure_table( virt, flags )->pages[ paging::page_idx( virt ) ].raw = phys | flags;
+    }
+
+    void page_allocator::map_range( virt::address_t virt, phys::address_t phys, size_t num, uint32_t flags ) {
         using namespace paging;
 
-        auto tab = virt >> 22;
-        auto entry = reinterpret_cast< page_entry * >( tab );
-        if ( !entry->present ) {
-            auto table = page_table::create();
-            kernel_page_dir->tables[ virt >> 22 ] = reinterpret_cast< page_table * >(
-                reinterpret_cast< uint32_t >( table ) | flags );
+        // entries that are not present do not point anywhere yet
+        size_t step = ( flags & 0x1 ) ? page::size : 0;
+        if ( flags & 0x1 )
+            stats::count.mapped_pages += num;
+
+        while ( num ) {
+            size_t idx = page_idx( virt );
+            size_t count = page_table::size - idx < num ? page_table::size - idx : num;
+
+            auto table = ensure_table( virt, flags );
+            for ( size_t i = 0; i < count; ++i, phys += step )
+                table->pages[ idx + i ].raw = phys | flags;
+
+            virt += count * page::size;
+            num -= count;
         }
+    }
 
-        get_page( virt ).raw = phys | flags;
+    void page_allocator::unmap_range( virt::address_t addr, size_t num, bool release ) {
+        using namespace paging;
+
+        bool global = false;
+        frame_allocator::frame run = { 0, 0 };
+
+        walk( addr, num, [&]( page_entry & entry, virt::address_t ) {
+            if ( entry.present ) {
+                global |= entry.global;
+                ++stats::count.unmapped_pages;
+
+                // a frame shared with another address space stays theirs
+                phys::address_t phys = entry.addr();
+                bool owned = release && !falloc.unshare( phys );
+
+                // physically contiguous frames go back as one block
+                if ( owned && run.size && run.addr + run.size * page::size == phys ) {
+                    ++run.size;
+                } else if ( owned ) {
+                    if ( run.valid() )
+                        falloc.free( run );
+                    run = { phys, 1 };
+                }
+            }
+            entry.raw = 0;
+        } );
+
+        flush( addr, num, global );
+
+        if ( run.valid() )
+            falloc.free( run );
     }
 
-    paging::page page_allocator::alloc( size_t num, bool user ) {
+    virt::address_t page_allocator::map_physical( phys::address_t phys, size_t size, uint32_t flags ) {
+        using namespace paging;
+
+        size_t offset = phys % page::size;
+        size_t num = ( offset + size + page::size - 1 ) / page::size;
+        auto addr = find_space( num, false );
+        if ( !addr )
+            return 0;
+
+        map_range( addr, phys - offset, num, flags );
+        return addr + offset;
+    }
+
+    void page_allocator::unmap_physical( virt::address_t addr, size_t size ) {
+        using namespace paging;
+
+        size_t offset = addr % page::size;
+        size_t num = ( offset + size + page::size - 1 ) / page::size;
+        unmap_range( addr - offset, num, false );
+        release_space( addr - offset, num );
+    }
+
+    void page_allocator::protect_range( virt::address_t addr, size_t num, uint32_t flags ) {
         using namespace paging;
+
+        constexpr uint32_t protection = 0x2 | 0x4;
+        bool global = false;
+
+        walk( addr, num, [&]( page_entry & entry, virt::address_t ) {
+            if ( entry.present || ( entry.raw & page_entry::demand_zero ) ) {
+                global |= entry.global;
+                entry.raw = ( entry.raw & ~protection ) | ( flags & protection );
+            }
+        } );
+
+        flush( addr, num, global );
+    }
+
+    void page_allocator::flush( virt::address_t addr, size_t num, bool global ) {
+        using namespace paging;
+
+        if ( num <= invlpg_threshold ) {
+            stats::count.invlpg += num;
+            for ( size_t i = 0; i < num; ++i )
+                asm volatile( "invlpg (%0)" :: "r"( addr + i * page::size ) : "memory" );
+            return;
+        }
+
+        ++stats::count.tlb_flushes;
+        if ( global && ( cpu::cr4::get() & cpu::cr4::pge ) ) {
+            // a CR3 reload keeps global entries, toggling PGE drops them too
+            auto cr4 = cpu::cr4::get();
+            cpu::cr4::set( cr4 & ~cpu::cr4::pge );
+            cpu::cr4::set( cr4 );
+        } else {
+            cpu::reload_cr3();
+        }
+    }
+
+    bool page_allocator::populate( virt::address_t addr, size_t num, bool user, bool lazy ) {
+        using namespace paging;
+        auto flags = user ? user_flags : kernel_flags;
+
+        if ( lazy ) {
+            map_range( addr, 0, num, ( flags & ~0x1 ) | page_entry::demand_zero );
+            return true;
+        }
+
+        frame_allocator::frame runs[ max_runs ];
+
+        size_t done = 0;
+        while ( done < num ) {
+            size_t count = falloc.alloc( num - done, runs, max_runs );
+            if ( count == 0 ) {
+                unmap_range( addr, done );
+                return false;
+            }
+
+            for ( size_t i = 0; i < count; ++i ) {
+                map_range( addr + done * page::size, runs[ i ].addr, runs[ i ].size, flags );
+                done += runs[ i ].size;
+            }
+        }
+
+        return true;
+    }
+
+    paging::page page_allocator::alloc( size_t num, bool user ) {
+        stats::timed timer( stats::page_alloc );
+
         auto addr = find_space( num, user );
+        if ( !addr )
+            return { 0, 0 };
 
-        for ( int i = 0; i < num; ++i )
-            if ( user )
-                map( falloc.alloc().addr, addr + i * page::size, user_flags );
-            else
-                map( falloc.alloc().addr, addr + i * page::size, kernel_flags );
+        if ( !populate( addr, num, user, false ) ) {
+            release_space( addr, num );
+            return { 0, 0 };
+        }
 
         return { addr, num };
     }
 
+    paging::page page_allocator::reserve( size_t num, bool user ) {
+        stats::timed timer( stats::page_alloc );
+
+        auto addr = find_space( num, user );
+        if ( !addr )
+            return { 0, 0 };
+
+        populate( addr, num, user, true );
+        return { addr, num };
+    }
+
     void page_allocator::unmap( virt::address_t addr ) {
-        reinterpret_cast< paging::page_entry * >( paging::get_table( addr ) )->present = 0;
+        unmap_range( addr, 1, false );
     }
 
     void page_allocator::free( paging::page page ) {
-        for ( int i = 0; i < page.num; ++i ) {
-            auto virt = page.addr + i * paging::page::size;
-            auto phys = virt_2_phys( virt );
-            unmap( virt );
-            falloc.free( { phys, 1 } );
-        }
+        stats::timed timer( stats::page_free );
+
+        unmap_range( page.addr, page.num );
+        release_space( page.addr, page.num );
     }
 
-    virt::address_t page_allocator::skip_used_pages( virt::address_t addr ) {
+    paging::page page_allocator::remap( paging::page page, size_t num, bool user ) {
         using namespace paging;
+        if ( num <= page.num )
+            return page;
+
+        size_t extra = num - page.num;
+
+        virt::address_t addr = page.addr;
+        bool in_place = space( user ).reserve( page.addr + page.num * page::size, extra );
+        if ( !in_place && !( addr = find_space( num, user ) ) )
+            return { 0, 0 };
+
+        // back the new tail first, a failure leaves the old mapping intact
+        virt::address_t tail = addr + page.num * page::size;
+        if ( !populate( tail, extra, user, extra >= lazy_threshold ) ) {
+            release_space( tail, extra );
+            if ( !in_place )
+                release_space( addr, page.num );
+            return { 0, 0 };
+        }
 
-        while ( true ) {
-            auto tab = get_table( addr );
-            if ( reinterpret_cast< page_entry * >( tab )->present ) {
-                for ( int i = page_idx( addr ); i < page_table::size; ++i ) {
-                    auto page = tab->pages[ i ];
-                    if ( !page.present )
-                        return addr + i * page::size;
+        // entries move as they are, pages not touched yet stay demand-zero;
+        // a checkpoint has only seen them at the old address
+        if ( !in_place ) {
+            walk( page.addr, page.num, [&]( page_entry & entry, virt::address_t from ) {
+                if ( entry.present || ( entry.raw & page_entry::demand_zero ) )
+                    map( entry.addr(), addr + ( from - page.addr ), entry.flags() & ~page_entry::saved );
+            } );
+            unmap_range( page.addr, page.num, false );
+            release_space( page.addr, page.num );
+        }
+
+        return { addr, num };
+    }
+
+    namespace {
+        using range = space_index::range;
+
+        // Every address space draws from here. Past the static items it
+        // grows by whole frames straight from falloc, the page allocator
+        // would need ranges itself.
+        struct range_pool {
+            static constexpr size_t size = 1024;
+
+            range * get() {
+                if ( !unused && used == size )
+                    grow();
+                if ( auto r = unused ) {
+                    unused = r->left;
+                    return r;
                 }
+                return used < size ? &items[ used++ ] : nullptr;
+            }
+
+            void grow() {
+                auto frame = falloc.alloc();
+                if ( !frame.valid() )
+                    return;
+
+                auto batch = reinterpret_cast< range * >( phys_2_virt( frame.addr ) );
+                for ( size_t i = 0; i < paging::page::size / sizeof( range ); ++i )
+                    put( &batch[ i ] );
+            }
+
+            void put( range * r ) {
+                r->left = unused;
+                unused = r;
+            }
+
+            range items[ size ];
+            range * unused = nullptr;
+            size_t used = 0;
+        };
+
+        range_pool rpool;
+
+        uint32_t next_priority() {
+            static uint32_t state = 2463534242u;
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+
+        virt::address_t range_end( range * r ) {
+            return r->addr + r->num * paging::page::size;
+        }
+
+        size_t largest( range * r ) {
+            return r ? r->largest : 0;
+        }
+
+        range * update( range * r ) {
+            r->largest = r->num;
+            if ( largest( r->left ) > r->largest )
+                r->largest = largest( r->left );
+            if ( largest( r->right ) > r->largest )
+                r->largest = largest( r->right );
+            return r;
+        }
+
+        range * make_range( virt::address_t addr, size_t num ) {
+            auto r = rpool.get();
+            if ( !r )
+                return nullptr;
 
-                addr = ( addr + page_table::size * page::size );
+            r->addr = addr;
+            r->num = num;
+            r->priority = next_priority();
+            r->left = r->right = nullptr;
+            return update( r );
+        }
+
+        // l gets the ranges starting below addr, r the rest
+        void split( range * t, virt::address_t addr, range *& l, range *& r ) {
+            if ( !t ) {
+                l = r = nullptr;
+            } else if ( t->addr < addr ) {
+                split( t->right, addr, t->right, r );
+                l = update( t );
             } else {
-                return addr;
+                split( t->left, addr, l, t->left );
+                r = update( t );
             }
         }
+
+        range * merge( range * l, range * r ) {
+            if ( !l || !r )
+                return l ? l : r;
+
+            if ( l->priority > r->priority ) {
+                l->right = merge( l->right, r );
+                return update( l );
+            }
+
+            r->left = merge( l, r->left );
+            return update( r );
+        }
+
+        range * rightmost( range * t ) {
+            while ( t && t->right )
+                t = t->right;
+            return t;
+        }
+
+        range * copy_tree( range * t ) {
+            if ( !t )
+                return nullptr;
+
+            auto c = rpool.get();
+            if ( !c ) {
+                fprintf( stderr, "Virtual range index is full\n" );
+                panic();
+            }
+
+            *c = *t;
+            c->left = copy_tree( t->left );
+            c->right = copy_tree( t->right );
+            return c;
+        }
+
+        void drop_tree( range * t ) {
+            if ( !t )
+                return;
+            drop_tree( t->left );
+            drop_tree( t->right );
+            rpool.put( t );
+        }
     }
 
-    size_t page_allocator::unused_space_from_addr( virt::address_t addr, bool user, size_t bound ) {
-        using namespace paging;
-        size_t free_pages = 0;
+    void space_index::init( virt::address_t begin, virt::address_t end ) {
+        root = make_range( begin, ( end - begin ) / paging::page::size );
+    }
+
+    void space_index::copy( const space_index & other ) {
+        clear();
+        root = copy_tree( other.root );
+    }
 
+    void space_index::clear() {
+        drop_tree( root );
+        root = nullptr;
+    }
+
+    virt::address_t space_index::alloc( size_t num ) {
+        if ( num == 0 || largest( root ) < num )
+            return 0;
+
+        // the lowest range that is large enough
+        range * t = root;
         while ( true ) {
-            if ( free_pages > bound )
-                return free_pages;
-            auto tab = get_table( addr );
-            if ( !reinterpret_cast< page_entry * >( tab )->present ) {
-                free_pages += page_table::size;
-                addr += page_table::size * page::size;
-            } else {
-                for ( int i = page_idx( addr ); i < page_table::size; ++i ) {
-                    auto page = tab->pages[ i ];
-                    if ( !page.present )
-                        free_pages++;
-                    else
-                        return free_pages;
-                }
+            if ( largest( t->left ) >= num )
+                t = t->left;
+            else if ( t->num >= num )
+                break;
+            else
+                t = t->right;
+        }
 
-                addr += ( page_table::size - page_idx( addr ) ) * page::size;
-            }
+        auto addr = t->addr;
+        return reserve( addr, num ) ? addr : 0;
+    }
+
+    bool space_index::reserve( virt::address_t addr, size_t num ) {
+        range * l, * r, * c;
+        split( root, addr + 1, l, r );
+
+        auto containing = rightmost( l );
+        auto end = addr + num * paging::page::size;
+        if ( !containing || range_end( containing ) < end ) {
+            root = merge( l, r );
+            return false;
+        }
+
+        range * after = nullptr;
+        if ( range_end( containing ) > end && !( after = make_range( end, ( range_end( containing ) - end ) / paging::page::size ) ) ) {
+            root = merge( l, r );
+            return false;
+        }
+
+        split( l, containing->addr, l, c );
+        if ( containing->addr < addr ) {
+            containing->num = ( addr - containing->addr ) / paging::page::size;
+            c = update( containing );
+        } else {
+            rpool.put( containing );
+            c = nullptr;
         }
 
-        return free_pages;
+        root = merge( merge( l, c ), merge( after, r ) );
+        return true;
+    }
+
+    void space_index::release( virt::address_t addr, size_t num ) {
+        auto end = addr + num * paging::page::size;
+
+        range * l, * r, * prev, * next;
+        split( root, addr, l, r );
+        split( r, end + 1, next, r );
+
+        // anything free inside the range means it was released already
+        auto candidate = rightmost( l );
+        if ( ( candidate && range_end( candidate ) > addr ) || ( next && ( next->left || next->right || next->addr < end ) ) ) {
+            fprintf( stderr, "Virtual range released twice\n" );
+            panic();
+        }
+
+        if ( candidate && range_end( candidate ) == addr ) {
+            split( l, candidate->addr, l, prev );
+            prev->num += num;
+        } else if ( !( prev = make_range( addr, num ) ) ) {
+            fprintf( stderr, "Virtual range index is full\n" );
+            panic();
+        }
+
+        if ( next ) {
+            prev->num += next->num;
+            rpool.put( next );
+        }
+
+        root = merge( merge( l, update( prev ) ), r );
     }
 
     virt::address_t page_allocator::find_space( size_t num, bool user ) {
+        ++stats::count.find_space;
+
+        auto addr = space( user ).alloc( num );
+        if ( !addr )
+            ++stats::count.find_space_failures;
+        return addr;
+    }
+
+    void page_allocator::release_space( virt::address_t addr, size_t num ) {
+        space( addr >= virt::user_begin ).release( addr, num );
+    }
+
+    namespace {
+        address_space kernel_address_space;
+
+        constexpr size_t first_user_table = paging::dir_index( virt::user_begin );
+        constexpr size_t last_user_table = paging::dir_index( virt::user_end );
+    }
+
+    address_space * address_space::create() {
+        auto space = reinterpret_cast< address_space * >( kmalloc( sizeof( address_space ) ) );
+        if ( !space )
+            return nullptr;
+
+        space->dir = paging::page_directory::create();
+        space->user_space.root = nullptr;
+        space->user_space.init( virt::user_begin, virt::user_end );
+        space->working_set = nullptr;
+        space->checkpoints = 0;
+        wss::track( *space );
+        return space;
+    }
+
+    address_space * address_space::clone() {
         using namespace paging;
 
-        virt::address_t addr = 0;
-        size_t free_pages = 0;
+        auto space = create();
+        if ( !space )
+            return nullptr;
 
-        while ( free_pages < num ) {
-            addr += free_pages * page::size;
-            addr = skip_used_pages( addr );
-            free_pages = unused_space_from_addr( addr, user, num );
+        space->user_space.copy( user_space );
+
+        for ( size_t i = first_user_table; i < last_user_table; ++i ) {
+            auto entry = dir->tables[ i ];
+            if ( !entry.present )
+                continue;
+
+            // only the current space has its tables above tables_base
+            auto dst = page_table::create();
+            auto src = reinterpret_cast< page_table * >( map_window( entry.addr() ) );
+
+            for ( size_t j = 0; j < page_table::size; ++j ) {
+                auto & page = src->pages[ j ];
+                if ( page.present ) {
+                    if ( page.rw ) {
+                        page.rw = 0;
+                        page.raw |= page_entry::cow;
+                    }
+                    falloc.share( page.addr() );
+                }
+                dst->pages[ j ].raw = page.raw & ~page_entry::saved;
+            }
+
+            space->dir->tables[ i ].raw = reinterpret_cast< uint32_t >( dst ) | entry.flags();
+            wss::add_table( *space, i * large_page_size );
         }
 
-        return addr;
+        // our writable pages just became read-only
+        if ( palloc.current == this )
+            cpu::reload_cr3();
+
+        return space;
+    }
+
+    void address_space::destroy() {
+        using namespace paging;
+
+        auto previous = palloc.current == this ? &kernel_address_space : palloc.current;
+
+        activate();
+        palloc.unmap_range( virt::user_begin, ( virt::user_end - virt::user_begin ) / page::size );
+        previous->activate();
+
+        for ( size_t i = first_user_table; i < last_user_table; ++i ) {
+            auto entry = dir->tables[ i ];
+            if ( entry.present )
+                falloc.free( { entry.addr(), 1 } );
+        }
+
+        falloc.free( { reinterpret_cast< uint32_t >( dir ), directory_frames } );
+        user_space.clear();
+        wss::release( *this );
+        kfree( this );
+    }
+
+    void address_space::activate() {
+        palloc.current = this;
+        paging::switch_page_dir( dir );
     }
 
     allocator _allocator;
 
+    namespace {
+        constexpr size_t heap_align = 8;
+
+        size_t heap_round( size_t size ) {
+            return ( size + heap_align - 1 ) & ~( heap_align - 1 );
+        }
+
+        void write_footer( allocator::node::metadata_footer & footer, size_t size ) {
+            footer.magic_begin = allocator::node::magic;
+            footer.size = size;
+            footer.magic_end = allocator::node::magic;
+        }
+    }
+
     bool allocator::node::fit( size_t size, bool user ) {
         return size <= __header.size && __header.free && __header.user == user;
     }
 
-    void * allocator::alloc( size_t size, bool user ) {
-        if ( size == 0 )
+    void allocator::node::init( size_t size, bool free, bool user ) {
+        __header.magic_begin = magic;
+        __header.size = size;
+        __header.next = __header.prev = nullptr;
+        __header.free = free;
+        __header.user = user;
+        __header.magic_end = magic;
+
+        if ( size != 0 )
+            write_footer( footer(), size );
+    }
+
+    void allocator::link( node * block ) {
+        block->header().prev = nullptr;
+        block->header().next = freelist;
+        if ( freelist )
+            freelist->header().prev = block;
+        freelist = block;
+    }
+
+    void allocator::unlink( node * block ) {
+        auto & header = block->header();
+        if ( header.prev )
+            header.prev->header().next = header.next;
+        else
+            freelist = header.next;
+        if ( header.next )
+            header.next->header().prev = header.prev;
+        header.next = header.prev = nullptr;
+    }
+
+    // A region is [ fence footer | blocks ... | fence header of size 0 ]
+    allocator::node * allocator::grow( size_t size, bool user ) {
+        using node_t = allocator::node;
+
+        size_t num = ( size + region_overhead + paging::page::size - 1 ) / paging::page::size;
+        auto page = num >= page_allocator::lazy_threshold ? palloc.reserve( num, user )
+                                                           : palloc.alloc( num, user );
+        if ( page.num == 0 )
             return nullptr;
 
-        node * curr = freelist;
-        while ( curr && curr->check() && !curr->fit( size, user ) )
-            curr = curr->next();
+        auto & begin = *reinterpret_cast< node_t::metadata_footer * >( page.addr );
+        write_footer( begin, node_t::fence );
 
-        constexpr size_t metadata_size = sizeof( node::metadata_header ) + sizeof( node::metadata_footer );
+        auto block = reinterpret_cast< node_t * >( page.addr + sizeof( node_t::metadata_footer ) );
+        block->init( num * paging::page::size - region_overhead, true, user );
+        block->next()->init( 0, false, user );
 
-        if ( !curr ) {
-            size_t alloc_pages = (size + metadata_size + paging::page::size - 1 ) / paging::page::size;
-            auto page = palloc.alloc( alloc_pages, user );
+        link( block );
+        return block;
+    }
 
-            size_t available_memory = alloc_pages * paging::page::size - metadata_size;
+    void allocator::split( node * block, size_t size ) {
+        size_t available = block->header().size;
+        if ( available < size + node::overhead + heap_align )
+            return;
 
-            curr = reinterpret_cast< node * >( virt_2_phys( page.addr ) );
-            curr->header().magic_begin = node::magic;
-            curr->header().size = available_memory;
-            curr->header().next = freelist;
-            curr->header().free = false;
-            curr->header().user = user;
-            curr->header().magic_end = node::magic;
+        block->header().size = size;
+        write_footer( block->footer(), size );
 
-            curr->footer().magic_begin = node::magic;
-            curr->footer().size = available_memory;
-            curr->footer().magic_end = node::magic;
-            freelist = curr;
+        auto rest = block->next();
+        rest->init( available - size - node::overhead, true, block->header().user );
+
+        auto next = rest->next();
+        if ( next->header().free ) {
+            unlink( next );
+            rest->header().size += node::overhead + next->header().size;
+            write_footer( rest->footer(), rest->header().size );
         }
 
-        size_t available_memory = curr->header().size;
-        if ( available_memory > size + metadata_size + 8 ) {
-            size_t free_space = available_memory - metadata_size - size;
+        link( rest );
+    }
 
-            curr->header().size = size;
+    allocator::node * allocator::take( node * block, size_t size ) {
+        unlink( block );
+        split( block, size );
+        block->header().free = false;
+        return block;
+    }
 
-            auto &footer = curr->footer();
-            footer.magic_begin = node::magic;
-            footer.size = size;
-            footer.magic_end = node::magic;
+    // Grows a block that is alone in its region by remapping the region,
+    // the data stays in the same frames.
+    allocator::node * allocator::remap( node * block, size_t size ) {
+        auto begin = reinterpret_cast< virt::address_t >( &block->prev_footer() );
+        auto end = reinterpret_cast< virt::address_t >( block->next() ) + sizeof( node::metadata_header );
 
-            node * next = reinterpret_cast< node * >(
-                          reinterpret_cast< uintptr_t >( &curr->footer() ) + sizeof( node::metadata_footer ) );
+        size_t num = ( size + region_overhead + paging::page::size - 1 ) / paging::page::size;
+        auto page = palloc.remap( { begin, ( end - begin ) / paging::page::size }, num, block->header().user );
+        if ( page.num == 0 )
+            return nullptr;
 
-            next->header().magic_begin = node::magic;
-            next->header().size = free_space;
-            next->header().next = curr->header().next;
-            next->header().free = true;
-            next->header().user = curr->header().user;
-            next->header().magic_end = node::magic;
+        block = reinterpret_cast< node * >( page.addr + sizeof( node::metadata_footer ) );
+        block->header().size = num * paging::page::size - region_overhead;
+        write_footer( block->footer(), block->header().size );
+        block->next()->init( 0, false, block->header().user );
 
-            next->footer().size = available_memory;
+        split( block, size );
+        return block;
+    }
 
-            curr->header().next = next;
-        }
+    void * allocator::alloc( size_t size, bool user ) {
+        if ( size == 0 )
+            return nullptr;
 
-        return curr->data();
+        stats::timed timer( stats::heap_alloc );
+        size = heap_round( size );
+
+        node * curr = freelist;
+        while ( curr && !curr->fit( size, user ) )
+            curr = curr->header().next;
+
+        if ( !curr && !( curr = grow( size, user ) ) )
+            return nullptr;
+
+        auto block = take( curr, size );
+        stats::count.heap_bytes += block->header().size;
+        return block->data();
     }
 
     void * allocator::realloc( void * ptr, size_t size, bool user ) {
+        if ( ptr == nullptr )
+            return alloc( size, user );
+
         auto node = reinterpret_cast< struct node * >(
                     reinterpret_cast< uintptr_t >( ptr ) - sizeof ( node::metadata_header ) );
+        if ( !node->check() || node->header().free )
+            panic();
 
-        if ( size < node->header().size )
+        size = heap_round( size );
+        if ( size <= node->header().size )
             return ptr;
 
+        size_t old_size = node->header().size;
+
+        // grow in place into a free neighbour
+        auto next = node->next();
+        if ( next->header().free && node->header().size + node::overhead + next->header().size >= size ) {
+            unlink( next );
+            node->header().size += node::overhead + next->header().size;
+            write_footer( node->footer(), node->header().size );
+            split( node, size );
+            stats::count.heap_bytes += node->header().size - old_size;
+            return ptr;
+        }
+
+        // a block spanning its whole region is moved by remapping its pages
+        bool alone = node->prev_footer().size == node::fence
+                  && ( next->header().size == 0
+                       || ( next->header().free && next->next()->header().size == 0 ) );
+        if ( alone ) {
+            if ( next->header().free ) {
+                unlink( next );
+                node->header().size += node::overhead + next->header().size;
+                write_footer( node->footer(), node->header().size );
+                stats::count.heap_bytes += node->header().size - old_size;
+                old_size = node->header().size;
+            }
+
+            if ( auto moved = remap( node, size ) ) {
+                stats::count.heap_bytes += moved->header().size - old_size;
+                return moved->data();
+            }
+        }
+
         auto place = alloc( size, user );
+        if ( !place )
+            return nullptr;
+
         memcpy( place, ptr, node->header().size );
 
         free( ptr );
@@ -445,23 +1593,246 @@ namespace kernel::mem {
     void allocator::free( void * ptr ) {
         if ( ptr == nullptr ) return;
 
+        stats::timed timer( stats::heap_free );
+
         auto curr = reinterpret_cast< node * >( (uintptr_t)ptr - sizeof( node::metadata_header ) );
+        if ( !curr->check() || curr->header().free )
+            panic();
+
         curr->header().free = true;
+        stats::count.heap_bytes -= curr->header().size;
+
+        auto next = curr->next();
+        if ( next->header().free ) {
+            unlink( next );
+            curr->header().size += node::overhead + next->header().size;
+            write_footer( curr->footer(), curr->header().size );
+        }
+
+        if ( curr->prev_footer().size != node::fence ) {
+            auto prev = curr->prev();
+            if ( prev->header().free ) {
+                unlink( prev );
+                prev->header().size += node::overhead + curr->header().size;
+                write_footer( prev->footer(), prev->header().size );
+                curr = prev;
+            }
+        }
+
+        // the whole region is free, hand its pages back
+        if ( curr->prev_footer().size == node::fence && curr->next()->header().size == 0 ) {
+            auto begin = reinterpret_cast< uintptr_t >( &curr->prev_footer() );
+            auto end = reinterpret_cast< uintptr_t >( curr->next() ) + sizeof( node::metadata_header );
+            palloc.free( { begin, ( end - begin ) / paging::page::size } );
+            return;
+        }
+
+        link( curr );
+    }
+
+    slab_allocator salloc;
+
+    size_t slab_allocator::size_class( size_t size ) {
+        if ( size <= min_size )
+            return 0;
+        if ( size > class_size( num_of_classes - 2 ) )
+            return num_of_classes - 1;
+        return order_of( size ) - order_of( min_size );
+    }
+
+    size_t slab_allocator::class_size( size_t cls ) {
+        return cls < num_of_classes - 1 ? min_size << cls : max_size;
+    }
+
+    slab_allocator::slab * slab_allocator::slab_of( void * ptr ) {
+        auto idx = paging::page::index( virt_2_phys( reinterpret_cast< virt::address_t >( ptr ) ) );
+        if ( idx >= num_of_frames || !( frames[ idx ].flags & frame_info::slab ) )
+            return nullptr;
+
+        return reinterpret_cast< slab * >( reinterpret_cast< uintptr_t >( ptr ) & ~( paging::page::size - 1 ) );
+    }
+
+    void * slab_allocator::alloc( size_t size ) {
+        stats::timed timer( stats::slab_alloc );
+
+        size_t cls = size_class( size );
+        slab * s = partial[ cls ];
+
+        if ( !s ) {
+            auto page = palloc.alloc( 1 );
+            if ( page.num == 0 )
+                return nullptr;
+
+            frames[ paging::page::index( virt_2_phys( page.addr ) ) ].flags |= frame_info::slab;
+
+            s = reinterpret_cast< slab * >( page.addr );
+            s->magic_begin = slab::magic;
+            s->cls = cls;
+            s->used = 0;
+            s->next = s->prev = nullptr;
+
+            // thread the free list through the objects
+            size_t obj_size = class_size( cls );
+            size_t count = ( paging::page::size - header_size ) / obj_size;
+            auto obj = reinterpret_cast< uintptr_t >( s->objects() );
+            s->free = reinterpret_cast< void * >( obj );
+            for ( size_t i = 0; i + 1 < count; ++i, obj += obj_size )
+                *reinterpret_cast< void ** >( obj ) = reinterpret_cast< void * >( obj + obj_size );
+            *reinterpret_cast< void ** >( obj ) = nullptr;
+
+            partial[ cls ] = s;
+        }
+
+        void * obj = s->free;
+        s->free = *reinterpret_cast< void ** >( obj );
+        s->used++;
+        ++stats::count.slab_objects[ cls ];
+
+        // a full slab leaves the partial list until something is freed
+        if ( !s->free ) {
+            partial[ cls ] = s->next;
+            if ( s->next )
+                s->next->prev = nullptr;
+            s->next = nullptr;
+        }
+
+        return obj;
+    }
+
+    void slab_allocator::free( void * ptr ) {
+        stats::timed timer( stats::slab_free );
+
+        auto s = reinterpret_cast< slab * >( reinterpret_cast< uintptr_t >( ptr ) & ~( paging::page::size - 1 ) );
+        if ( s->magic_begin != slab::magic )
+            panic();
+        --stats::count.slab_objects[ s->cls ];
+
+        if ( !s->free ) {
+            s->prev = nullptr;
+            s->next = partial[ s->cls ];
+            if ( s->next )
+                s->next->prev = s;
+            partial[ s->cls ] = s;
+        }
+
+        *reinterpret_cast< void ** >( ptr ) = s->free;
+        s->free = ptr;
+        s->used--;
+
+        // empty slabs go back to the page allocator, except the last one of a class
+        if ( s->used == 0 && ( s->prev || s->next ) ) {
+            if ( s->prev )
+                s->prev->next = s->next;
+            else
+                partial[ s->cls ] = s->next;
+            if ( s->next )
+                s->next->prev = s->prev;
+
+            auto addr = reinterpret_cast< virt::address_t >( s );
+            frames[ paging::page::index( virt_2_phys( addr ) ) ].flags &= ~frame_info::slab;
+            s->magic_begin = 0;
+            palloc.free( { addr, 1 } );
+        }
+    }
+
+    void * kmalloc( size_t size ) {
+        if ( size == 0 )
+            return nullptr;
+
+        stats::request( size );
+        if ( size <= slab_allocator::max_size )
+            return salloc.alloc( size );
+        return _allocator.alloc( size );
+    }
+
+    void kfree( void * ptr ) {
+        if ( ptr == nullptr )
+            return;
+        if ( slab_allocator::slab_of( ptr ) )
+            salloc.free( ptr );
+        else
+            _allocator.free( ptr );
+    }
+
+    void * krealloc( void * ptr, size_t size ) {
+        if ( ptr == nullptr )
+            return kmalloc( size );
+
+        if ( size == 0 ) {
+            kfree( ptr );
+            return nullptr;
+        }
+
+        auto s = slab_allocator::slab_of( ptr );
+        if ( !s )
+            return _allocator.realloc( ptr, size );
+
+        size_t old_size = slab_allocator::class_size( s->cls );
+        if ( size <= old_size )
+            return ptr;
+
+        void * place = kmalloc( size );
+        if ( place ) {
+            memcpy( place, ptr, old_size );
+            salloc.free( ptr );
+        }
+        return place;
     }
 
     void init( const multiboot::info & info ) {
         using namespace paging;
+
+        if ( stats::timing_enabled && !cpu::has( cpu::tsc ) ) {
+            fprintf( stderr, "Allocator timers need a TSC\n" );
+            panic();
+        }
+
         frame_allocator::init( info );
 
         paging::kernel_page_dir = page_directory::create();
 
-        for ( size_t i = 0; i < num_of_pages; i += page_table::size * page::size )
-            identity_map_page( paging::kernel_page_dir, i, i );
+#ifdef THINGY_PAE
+        if ( !cpu::has( cpu::pae ) ) {
+            fprintf( stderr, "The CPU does not support PAE\n" );
+            panic();
+        }
+        cpu::cr4::set( cpu::cr4::get() | cpu::cr4::pae );
+        // PAE directories always understand 2 MiB pages
+        bool large = true;
+#else
+        bool large = cpu::has( cpu::pse );
+        if ( large )
+            cpu::cr4::set( cpu::cr4::get() | cpu::cr4::pse );
+#endif
+        // kernel mappings are global and survive address space switches
+        if ( cpu::has( cpu::pge ) )
+            cpu::cr4::set( cpu::cr4::get() | cpu::cr4::pge );
+
+        // the first large page keeps small pages, page 0 stays unmapped to catch
+        // null pointers; the kernel is linked above it, see linkscript
+        size_t identity_end = 0;
+        for ( ; identity_end < direct_end; identity_end += large_page_size ) {
+            if ( large && identity_end != 0 )
+                identity_map_large( paging::kernel_page_dir, identity_end );
+            else
+                identity_map_page( paging::kernel_page_dir, identity_end, identity_end );
+        }
+        // paging is still off, the table is reached through its physical address
+        static_cast< page_table * >( phys_2_virt( kernel_page_dir->tables[ 0 ].addr() ) )->pages[ 0 ].raw = 0;
+
+        // every directory shares these, so they have to exist from the start
+        for ( auto addr = identity_end; addr < virt::kernel_end; addr += large_page_size )
+            kernel_page_dir->tables[ dir_index( addr ) ].raw = reinterpret_cast< uint32_t >( page_table::create() ) | 0x3;
 
         page_allocator::init( &falloc );
+        palloc.kernel_space.init( identity_end, virt::kernel_end );
+        window = palloc.kernel_space.alloc( 1 );
+
+        kernel_address_space.dir = kernel_page_dir;
+        kernel_address_space.user_space.init( virt::user_begin, virt::user_end );
 
         isrs::install_handler( 14, paging::page_fault_handler );
 
-        paging::switch_page_dir( paging::kernel_page_dir );
+        kernel_address_space.activate();
     }
 } // namespace kernel::mem
@@ -0,0 +1,84 @@
+#include <kernel/memstat.hpp>
+#include <kernel/wss.hpp>
+
+#include <stdio.h>
+
+namespace kernel::mem::stats {
+
+    counters count;
+    timing timings[ num_of_timers ];
+
+    namespace {
+        const char * timer_names[ num_of_timers ] = {
+            "frame_alloc", "frame_free", "page_alloc", "page_free",
+            "slab_alloc", "slab_free", "heap_alloc", "heap_free"
+        };
+
+        unsigned long long ull( uint64_t val ) {
+            return val;
+        }
+    } // anonymous namespace
+
+    void request( size_t size ) {
+        size_t bucket = size <= 1 ? 0 : 32 - __builtin_clz( size - 1 );
+        ++count.request_sizes[ bucket < size_buckets ? bucket : size_buckets - 1 ];
+    }
+
+    void report() {
+        size_t free = falloc.free_frames, zeroed = falloc.num_zeroed;
+        size_t used = falloc.total_frames - free - zeroed - falloc.reserved_frames;
+
+        printf( "mem frames total=%u free=%u used=%u reserved=%u zeroed=%u\n",
+                unsigned( falloc.total_frames ), unsigned( free ), unsigned( used ),
+                unsigned( falloc.reserved_frames ), unsigned( zeroed ) );
+
+        for ( size_t z = 0; z < frame_allocator::num_of_zones; ++z ) {
+            auto zone = frame_allocator::zone( z );
+            printf( "mem buddy zone=%s", zone == frame_allocator::direct ? "direct" : "high" );
+            for ( size_t order = 0; order <= frame_allocator::max_order; ++order )
+                printf( " order%u=%u", unsigned( order ), unsigned( falloc.free_blocks( zone, order ) ) );
+            printf( "\n" );
+        }
+
+        for ( size_t cls = 0; cls < slab_allocator::num_of_classes; ++cls ) {
+            auto size = slab_allocator::class_size( cls );
+            printf( "mem slab size=%u objects=%llu bytes=%llu\n", unsigned( size ),
+                    ull( count.slab_objects[ cls ] ), ull( count.slab_objects[ cls ] * size ) );
+        }
+
+        size_t blocks = 0, largest = 0;
+        for ( auto block = _allocator.freelist; block; block = block->header().next ) {
+            ++blocks;
+            if ( block->header().size > largest )
+                largest = block->header().size;
+        }
+        printf( "mem heap bytes=%llu freelist=%u largest=%u\n",
+                ull( count.heap_bytes ), unsigned( blocks ), unsigned( largest ) );
+
+        printf( "mem faults total=%llu demand_zero=%llu cow=%llu cow_copies=%llu\n",
+                ull( count.page_faults ), ull( count.demand_zero_faults ),
+                ull( count.cow_faults ), ull( count.cow_copies ) );
+
+        printf( "mem paging mapped=%llu unmapped=%llu invlpg=%llu flushes=%llu\n",
+                ull( count.mapped_pages ), ull( count.unmapped_pages ),
+                ull( count.invlpg ), ull( count.tlb_flushes ) );
+
+        printf( "mem find_space calls=%llu failures=%llu\n",
+                ull( count.find_space ), ull( count.find_space_failures ) );
+
+        printf( "mem sizes" );
+        for ( size_t i = 0; i + 1 < size_buckets; ++i )
+            printf( " le%u=%llu", 1u << i, ull( count.request_sizes[ i ] ) );
+        printf( " more=%llu", ull( count.request_sizes[ size_buckets - 1 ] ) );
+        printf( "\n" );
+
+        if ( !timing_enabled )
+            puts( "mem timer disabled=1" );
+        for ( size_t t = 0; timing_enabled && t < num_of_timers; ++t )
+            printf( "mem timer name=%s calls=%llu cycles=%llu\n", timer_names[ t ],
+                    ull( timings[ t ].calls ), ull( timings[ t ].cycles ) );
+
+        wss::report( *palloc.current );
+    }
+
+} // namespace kernel::mem::stats
@@ -8,8 +8,14 @@ using namespace kernel::dev;
 #include <kernel/panic.hpp>
 #include <kernel/mem.hpp>
 #include <kernel/dt.hpp>
+#include <kernel/apic.hpp>
+#include <kernel/deferred.hpp>
+#include <kernel/irqstat.hpp>
 #include <kernel/user.hpp>
 #include <kernel/syscall.hpp>
+#include <kernel/bench.hpp>
+#include <kernel/memstat.hpp>
+#include <kernel/wss.hpp>
 
 #include <multiboot2.h>
 #include <stdio.h>
@@ -28,6 +34,24 @@ void test_handler( registers_t * regs ) {
     printf( "in irq handler %d\n", regs->int_no );
 }
 
+// Modules are used in place when they own their frames, copied otherwise.
+static user::executable::section load_module( const multiboot::modules_information & mod ) {
+    auto frames = mem::falloc.adopt( mod );
+    if ( frames.valid() )
+        return { frames.addr, frames.size };
+
+    size_t size = mod.end - mod.start;
+    size_t num = ( size + mem::paging::page::size - 1 ) / mem::paging::page::size;
+
+    auto copy = mem::falloc.alloc( num );
+    if ( !copy.valid() )
+        panic();
+
+    memcpy( mem::phys_2_virt( copy.addr ), mem::phys_2_virt( mod.start ), size );
+    memset( mem::phys_2_virt( copy.addr + size ), 0, num * mem::paging::page::size - size );
+    return { copy.addr, copy.size };
+}
+
 void Thingy::start( unsigned long magic, unsigned long addr ) noexcept {
     Serial ser{ Serial::Port::one };
     VGA kvga{ video };
@@ -44,8 +68,16 @@ void Thingy::start( unsigned long magic, unsigned long addr ) noexcept {
 
     mem::init( info );
 
+    if ( !apic::init( info ) )
+        puts( "No APIC found, interrupts stay with the 8259 PIC" );
+
+    if ( irq::stats::enabled )
+        irq::stats::reset();
+
     syscall::init();
 
+    mem::wss::start();
+
     user::executable program;
 
     info.yield( multiboot::information_type::module, [&program] ( const auto & item ) {
@@ -60,19 +92,11 @@ void Thingy::start( unsigned long magic, unsigned long addr ) noexcept {
     puts( "===============================================================================" );
 
         if ( strcmp( mod->command, "program.data" ) == 0 ) {
-            program.data.size = ( mod->end - mod->start  + page::size - 1 ) / page::size;
-            program.data.addr = mem::virt_2_phys( mem::palloc.alloc( program.text.size ).addr );
-            memcpy( ( void * )program.data.addr, begin, end - begin );
-
-
-
+            program.data = load_module( *mod );
             puts( "binary module" );
         } else if ( strcmp( mod->command, "program.text" ) == 0 ) {
-            program.text.size = ( mod->end - mod->start  + page::size - 1 ) / page::size;
-            program.text.addr = mem::virt_2_phys( mem::palloc.alloc( program.text.size ).addr );
-            memcpy( ( void * )program.text.addr, begin, end - begin );
-            printf("%02X\n", * ( unsigned * )begin );
-            printf("%02X\n", * ( unsigned * )program.text.addr );
+            program.text = load_module( *mod );
+            printf("%02X\n", * ( unsigned * )mem::phys_2_virt( program.text.addr ) );
             puts( "binary module" );
         } else {
             for ( auto it = begin; it < end; ++it ) {
@@ -84,6 +108,13 @@ void Thingy::start( unsigned long magic, unsigned long addr ) noexcept {
     puts( "\nInitialization of Thingy finished." );
     puts( "===============================================================================" );
 
+#ifdef THINGY_BENCH
+    bench::run();
+    mem::stats::report();
+    deferred::report();
+    irq::stats::report();
+#endif
+
     int ret = program.start();
 
     puts( "===============================================================================" );
@@ -108,6 +139,15 @@ void Thingy::start( unsigned long magic, unsigned long addr ) noexcept {
     }*/
 }
 
+void Thingy::halt() noexcept {
+    // idle time goes into zeroing frames ahead of time, interrupts only
+    // come in while halted
+    while ( true ) {
+        if ( !mem::falloc.prezero() )
+            asm volatile( "sti; hlt; cli" ::: "memory" );
+    }
+}
+
 void Thingy::init_devices( dev::Serial *ser, dev::VGA *_vga ) noexcept {
     serial = ser; ser->init();
     vga = _vga;
@@ -116,5 +156,6 @@ void Thingy::init_devices( dev::Serial *ser, dev::VGA *_vga ) noexcept {
 extern "C" void main( unsigned long magic, unsigned long addr, unsigned int esp ) {
     stack_ptr = esp;
     Thingy::start( magic, addr );
+    Thingy::halt();
 }
 
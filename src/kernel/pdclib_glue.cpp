@@ -15,15 +15,15 @@ extern "C" void _PDCLIB_Exit( int status ) {
 }
 
 extern "C" void free( void * ptr ) noexcept {
-    return kernel::mem::_allocator.free( ptr );
+    return kernel::mem::kfree( ptr );
 }
 
 extern "C" void * malloc( size_t size ) noexcept {
-    return kernel::mem::_allocator.alloc( size );
+    return kernel::mem::kmalloc( size );
 }
 
 extern "C" void * realloc( void * ptr, size_t size ) noexcept {
-    return kernel::mem::_allocator.realloc( ptr, size );
+    return kernel::mem::krealloc( ptr, size );
 }
 
 static bool readf( _PDCLIB_fd_t self, void * buff, size_t length, size_t * numBytesRead ) {
@@ -0,0 +1,80 @@
+#include <kernel/snapshot.hpp>
+#include <kernel/memstat.hpp>
+
+#include <stdio.h>
+
+namespace kernel::mem::snapshot {
+
+    namespace {
+        constexpr size_t first_table = paging::dir_index( virt::user_begin );
+        constexpr size_t last_table = paging::dir_index( virt::user_end );
+
+        // calls fn( addr, entry ) for every user page a checkpoint has to record
+        template< typename Fn >
+        void changed( Fn fn ) {
+            using namespace paging;
+
+            for ( size_t i = first_table; i < last_table; ++i ) {
+                virt::address_t addr = i * large_page_size;
+                if ( !get_dir_entry( addr ).present )
+                    continue;
+
+                auto pages = &get_page( addr );
+                for ( size_t j = 0; j < page_table::size; ++j ) {
+                    auto & entry = pages[ j ];
+                    if ( entry.present && ( entry.dirty || !( entry.raw & page_entry::saved ) ) )
+                        fn( addr + j * page::size, entry );
+                }
+            }
+        }
+
+        bool is_zero( virt::address_t addr ) {
+            auto words = reinterpret_cast< const uint32_t * >( addr );
+            for ( size_t i = 0; i < paging::page::size / sizeof( uint32_t ); ++i )
+                if ( words[ i ] )
+                    return false;
+            return true;
+        }
+    } // anonymous namespace
+
+    void console( const void * data, size_t size ) {
+        fwrite( data, 1, size, stdout );
+        fflush( stdout );
+    }
+
+    size_t checkpoint( address_space & space, writer out ) {
+        using namespace paging;
+
+        // the tables and pages are only reachable while the space is current
+        auto previous = palloc.current;
+        if ( previous != &space )
+            space.activate();
+
+        header head = { magic, space.checkpoints, 0 };
+        changed( [&]( virt::address_t, page_entry & ) { ++head.pages; } );
+        out( &head, sizeof( head ) );
+
+        changed( [&]( virt::address_t addr, page_entry & entry ) {
+            bool empty = is_zero( addr );
+            uint32_t record = addr | ( empty ? zero : 0 );
+            out( &record, sizeof( record ) );
+            if ( !empty )
+                out( reinterpret_cast< const void * >( addr ), page::size );
+
+            entry.dirty = 0;
+            entry.raw |= page_entry::saved;
+        } );
+
+        // cached translations would not set the dirty bits again
+        if ( previous != &space ) {
+            previous->activate();
+        } else if ( head.pages ) {
+            ++stats::count.tlb_flushes;
+            cpu::reload_cr3();
+        }
+
+        ++space.checkpoints;
+        return head.pages;
+    }
+
+} // namespace kernel::mem::snapshot
@@ -1,12 +1,93 @@
 #include <kernel/syscall.hpp>
+#include <kernel/cpu.hpp>
+#include <kernel/dt.hpp>
+#include <kernel/mem.hpp>
+#include <kernel/user.hpp>
+
+#include <stdio.h>
+
+extern uint32_t tss[ 26 ];
+
+extern "C" {
+    extern kernel::idt idt_ptr;
+
+    void syscall_gate();
+    void syscall_fast();
+
+    int syscall_unknown( uint32_t, uint32_t, uint32_t ) { return -1; }
+
+    kernel::syscall::handler syscall_table[ kernel::syscall::num_of_calls ];
+
+    // both entries of boot.S end up here
+    int syscall_dispatch( uint32_t nr, uint32_t a, uint32_t b, uint32_t c ) {
+        if ( nr >= kernel::syscall::num_of_calls )
+            return -1;
+        return syscall_table[ nr ]( a, b, c );
+    }
+}
 
 namespace kernel {
     namespace syscall {
 
+        namespace {
+            constexpr uint32_t sysenter_cs = 0x174;
+            constexpr uint32_t sysenter_esp = 0x175;
+            constexpr uint32_t sysenter_eip = 0x176;
+
+            constexpr size_t stack_size = 0x4000;
+
+            // one user program at a time, they all enter the kernel here
+            alignas( 16 ) uint8_t stack[ stack_size ];
+
+            bool fast_entry;
+
+            int nop( uint32_t, uint32_t, uint32_t ) { return 0; }
+
+            int debug_call( uint32_t val, uint32_t, uint32_t ) { return debug( val ); }
+
+            int exit_call( uint32_t val, uint32_t, uint32_t ) { user::leave( val ); }
+        } // anonymous namespace
+
+        void install( uint32_t nr, syscall::handler handler ) {
+            syscall_table[ nr ] = handler;
+        }
+
+        void uninstall( uint32_t nr ) {
+            syscall_table[ nr ] = syscall_unknown;
+        }
+
+        bool fast() {
+            return fast_entry;
+        }
+
         void init() {
+            for ( size_t i = 0; i < num_of_calls; ++i )
+                syscall_table[ i ] = syscall_unknown;
+
+            install( nr::nop, nop );
+            install( nr::debug, debug_call );
+            install( nr::exit, exit_call );
+
+            mem::set_kernel_stack( reinterpret_cast< uintptr_t >( stack + stack_size ) );
 
+            // DPL 3 interrupt gate
+            idt_ptr.set( vector, reinterpret_cast< const void * >( syscall_gate ), 0x08, 0xEE );
+
+            if ( !cpu::has( cpu::sep ) || !cpu::has( cpu::msr ) )
+                return;
+
+            // Kernel SS and the user selectors follow the kernel CS in the
+            // GDT, as sysenter and sysexit expect. The entry loads ESP0 from
+            // the TSS, so it needs no update when the kernel stack changes.
+            cpu::wrmsr( sysenter_cs, 0x08 );
+            cpu::wrmsr( sysenter_esp, reinterpret_cast< uintptr_t >( &tss[ 1 ] ) );
+            cpu::wrmsr( sysenter_eip, reinterpret_cast< uintptr_t >( syscall_fast ) );
+            fast_entry = true;
         }
 
-        int debug( int ) { return 0; }
+        int debug( int val ) {
+            printf( "user debug %d\n", val );
+            return 0;
+        }
     } // namespace syscall
 } // namespace kernel
@@ -4,32 +4,71 @@
 
 #include <stdio.h>
 
-extern "C" int __jump_to_userland( void *code, void * stack );
+extern "C" int __enter_userland( void * code, void * stack );
+extern "C" [[noreturn]] void __leave_userland( int value );
 
 namespace kernel {
     namespace user {
 
-        uint32_t stack[ stack_size ];
+        namespace {
+            mem::address_space * map_image( const executable & program ) {
+                auto previous = mem::palloc.current;
+                auto space = mem::address_space::create();
+                if ( !space )
+                    return nullptr;
+                space->activate();
+
+                // sections are physically contiguous, their frames are mapped as they are
+                auto flags = mem::page_allocator::user_flags;
+                bool mapped = space->user_space.reserve( text_base, program.text.size )
+                           && space->user_space.reserve( data_base, program.data.size );
+                if ( mapped ) {
+                    mem::palloc.map_range( text_base, program.text.addr, program.text.size, flags & ~0x2 );
+                    mem::palloc.map_range( data_base, program.data.addr, program.data.size, flags );
+                }
+
+                previous->activate();
+                if ( !mapped ) {
+                    space->destroy();
+                    return nullptr;
+                }
+                return space;
+            }
+        } // anonymous namespace
+
+        int executable::start() {
+            using mem::paging::page;
 
-        int executable::start() const {
             puts( "\nStarting user program.\n" );
 
-            // map pages
-            auto flags = mem::page_allocator::user_flags;
+            if ( !image && !( image = map_image( *this ) ) )
+                return -1;
 
-            auto code_addr = mem::palloc.find_space( text.size, true );
-            for ( size_t i = 0; i < text.size; ++i ) {
-                auto addr = text.addr + i * mem::paging::page::size;
-                mem::palloc.map( addr, code_addr, flags );
-            }
+            // every run gets an address space of its own
+            auto previous = mem::palloc.current;
+            auto space = image->clone();
+            if ( !space )
+                return -1;
+            space->activate();
 
-            auto data_addr = mem::palloc.find_space( data.size, true );
-            for ( size_t i = 0; i < data.size; ++i ) {
-                auto addr = data.addr + i * mem::paging::page::size;
-                mem::palloc.map( addr, data.addr, flags );
-            }
+            int ret = -1;
+            auto stack = mem::palloc.alloc( stack_size / page::size, true );
+            if ( stack.num )
+                ret = enter( reinterpret_cast< void * >( text_base ),
+                             reinterpret_cast< void * >( stack.addr + stack.num * page::size ) );
+
+            // shared frames only lose a reference, copies and the stack are freed
+            previous->activate();
+            space->destroy();
+            return ret;
+        }
+
+        int enter( void * code, void * stack ) {
+            return __enter_userland( code, stack );
+        }
 
-            return __jump_to_userland( ( void * )mem::virt_2_phys( code_addr ), stack );
+        void leave( int value ) {
+            __leave_userland( value );
         }
 
     } // namespace user
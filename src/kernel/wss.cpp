@@ -0,0 +1,174 @@
+#include <kernel/wss.hpp>
+#include <kernel/memstat.hpp>
+#include <kernel/deferred.hpp>
+#include <kernel/ioport.hpp>
+#include <kernel/dt.hpp>
+
+#include <stdio.h>
+#include <string.h>
+
+namespace kernel::mem::wss {
+
+    namespace {
+        // channel 0 divides this rate by a 16-bit divisor
+        constexpr uint32_t pit_rate = 1193182;
+
+        uint32_t ticks;
+        deferred::work scan_work;
+
+        void tick( unsigned vector ) {
+            if ( ++ticks % interval == 0 )
+                deferred::queue( vector, &scan_work );
+        }
+
+        size_t bucket( uint8_t age ) {
+            size_t b = age == 0 ? 0 : 32 - __builtin_clz( age );
+            return b < age_buckets ? b : age_buckets - 1;
+        }
+
+        void * zalloc( size_t size ) {
+            auto ptr = kmalloc( size );
+            if ( ptr )
+                memset( ptr, 0, size );
+            return ptr;
+        }
+    } // anonymous namespace
+
+    bool track( address_space & space ) {
+        if ( !space.working_set )
+            space.working_set = static_cast< tracker * >( zalloc( sizeof( tracker ) ) );
+        return space.working_set;
+    }
+
+    void add_table( address_space & space, virt::address_t addr ) {
+        auto t = space.working_set;
+        auto i = paging::dir_index( addr ) - paging::dir_index( virt::user_begin );
+        if ( !t || t->ages[ i ] )
+            return;
+
+        // not seen accessed until a scan says otherwise
+        t->ages[ i ] = static_cast< uint8_t * >( kmalloc( paging::page_table::size ) );
+        if ( t->ages[ i ] )
+            memset( t->ages[ i ], max_age, paging::page_table::size );
+    }
+
+    bool scan( address_space & space ) {
+        using namespace paging;
+
+        auto t = space.working_set;
+        if ( !t )
+            return false;
+
+        // the tables are only reachable while the space is current
+        auto previous = palloc.current;
+        if ( previous != &space )
+            space.activate();
+
+        histogram h = {};
+        bool cleared = false, complete = true;
+        for ( size_t i = 0; i < tracker::tables && complete; ++i ) {
+            auto addr = virt::user_begin + i * large_page_size;
+            if ( !get_dir_entry( addr ).present )
+                continue;
+
+            if ( !t->ages[ i ] ) {
+                complete = false;
+                break;
+            }
+
+            auto pages = &get_page( addr );
+            auto ages = t->ages[ i ];
+            for ( size_t j = 0; j < page_table::size; ++j ) {
+                auto & entry = pages[ j ];
+                if ( !entry.present ) {
+                    ages[ j ] = max_age;
+                    continue;
+                }
+
+                if ( entry.accessed ) {
+                    entry.accessed = 0;
+                    ages[ j ] = 0;
+                    cleared = true;
+                } else if ( ages[ j ] < max_age ) {
+                    ++ages[ j ];
+                }
+
+                ++h.present;
+                h.dirty += entry.dirty;
+                ++h.pages[ bucket( ages[ j ] ) ];
+            }
+        }
+
+        // cached translations would not set the accessed bits again
+        if ( previous != &space ) {
+            previous->activate();
+        } else if ( cleared ) {
+            ++stats::count.tlb_flushes;
+            cpu::reload_cr3();
+        }
+
+        if ( complete ) {
+            t->last = h;
+            ++t->scans;
+        }
+        return complete;
+    }
+
+    void start() {
+        scan_work.fn = [] ( deferred::work * ) { scan( *palloc.current ); };
+
+        // channel 0, low then high byte of the divisor, rate generator
+        uint32_t divisor = pit_rate / hz;
+        dev::outb( 0x43, 0x34 );
+        dev::outb( 0x40, divisor & 0xFF );
+        dev::outb( 0x40, divisor >> 8 );
+
+        irq::install_handler( 0, tick );
+        irq::enable( 0 );
+    }
+
+    size_t estimate( const address_space & space, unsigned scans ) {
+        auto t = space.working_set;
+        if ( !t )
+            return 0;
+
+        if ( scans > max_age )
+            scans = max_age;
+
+        size_t num = 0;
+        for ( size_t i = 0; i < tracker::tables; ++i ) {
+            if ( !t->ages[ i ] )
+                continue;
+            for ( size_t j = 0; j < paging::page_table::size; ++j )
+                num += t->ages[ i ][ j ] < scans;
+        }
+        return num;
+    }
+
+    void release( address_space & space ) {
+        auto t = space.working_set;
+        if ( !t )
+            return;
+
+        for ( size_t i = 0; i < tracker::tables; ++i )
+            kfree( t->ages[ i ] );
+        kfree( t );
+        space.working_set = nullptr;
+    }
+
+    void report( const address_space & space ) {
+        auto t = space.working_set;
+        if ( !t ) {
+            puts( "mem wss scans=0" );
+            return;
+        }
+
+        printf( "mem wss scans=%llu present=%u dirty=%u", static_cast< unsigned long long >( t->scans ),
+                unsigned( t->last.present ), unsigned( t->last.dirty ) );
+        for ( size_t b = 0; b < age_buckets; ++b )
+            printf( " age%u=%u", b == 0 ? 0u : 1u << ( b - 1 ), unsigned( t->last.pages[ b ] ) );
+        printf( " wss1=%u wss4=%u wss16=%u\n", unsigned( estimate( space, 1 ) ),
+                unsigned( estimate( space, 4 ) ), unsigned( estimate( space, 16 ) ) );
+    }
+
+} // namespace kernel::mem::wss